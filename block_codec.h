@@ -0,0 +1,513 @@
+#pragma once
+
+// integer codecs for the 128-posting blocks of the inverted index
+// the doc part (docId gaps) and the freq part of every block are encoded separately, each with its own codec,
+// the codec ids are kept in the top bits of BlockMetadata.docSize (see index_writer.h), so indexes written before
+// codecs existed read back as varbyte
+//
+//   CODEC_VARBYTE      7 bits per byte, high bit set on all but the last byte (the original format)
+//   CODEC_BITPACK      [n][b] then n values of b bits, b = bits of the largest value
+//   CODEC_PFOR         [n][b][exception count] then n values of b bits, then (position, varbyte value >> b) per value that did not fit
+//   CODEC_STREAMVBYTE  [n] then (n + 3) / 4 control bytes (2 bit byte length - 1 per value) then 1-4 little endian bytes per value
+//
+// decoders write whole blocks into a uint32_t array, with SSSE3 varbyte (Masked VByte) and Stream VByte decode
+// up to 4 values per shuffle, and prefixSum turns a block of gaps back into docIds 4 lanes at a time
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+const size_t BLOCK_CODEC_MAX_VALUES = 128; // decoders never write more than this many values
+
+enum BlockCodec
+{
+    CODEC_VARBYTE = 0,
+    CODEC_BITPACK = 1,
+    CODEC_PFOR = 2,
+    CODEC_STREAMVBYTE = 3,
+    CODEC_COUNT = 4,
+    CODEC_AUTO = -1 // index builder only: smallest of all codecs, per block and part
+};
+
+inline const char *codecName(int codec)
+{
+    static const char *names[] = {"varbyte", "bitpack", "pfor", "streamvbyte"};
+    return codec >= 0 && codec < CODEC_COUNT ? names[codec] : "auto";
+}
+
+// CODEC_COUNT if the name is unknown
+inline int codecFromName(const std::string &name)
+{
+    if (name == "auto")
+    {
+        return CODEC_AUTO;
+    }
+    for (int codec = 0; codec < CODEC_COUNT; ++codec)
+    {
+        if (name == codecName(codec))
+        {
+            return codec;
+        }
+    }
+    return CODEC_COUNT;
+}
+
+// VARBYTE ENCODING
+inline void writeByte(std::vector<unsigned char> &buffer, uint8_t val) // 8 byte num
+{
+    buffer.push_back(val);
+}
+
+inline void varbyteEncode(std::vector<unsigned char> &buffer, uint32_t num)
+{
+    while (num >= 128)
+    {
+        writeByte(buffer, 128 + (num & 127)); // set the 1 and then the next 7 bits
+        num >>= 7;                            // right shift by 7 bits
+    }
+    writeByte(buffer, static_cast<uint8_t>(num)); // without the 1 bit at the front
+}
+
+inline const unsigned char *varbyteDecode(const unsigned char *in, uint32_t &num)
+{
+    num = 0;
+    uint32_t shift = 0;
+    uint8_t curr;
+    do
+    {
+        curr = *in++;
+        num |= static_cast<uint32_t>(curr & 127) << shift;
+        shift += 7;
+    } while (curr >= 128);
+    return in;
+}
+
+inline int bitsNeeded(uint32_t value)
+{
+    return value == 0 ? 0 : 32 - __builtin_clz(value);
+}
+
+inline uint32_t lowMask(int bits)
+{
+    return bits >= 32 ? 0xFFFFFFFFu : (1u << bits) - 1;
+}
+
+// BIT PACKING
+inline void packBits(const uint32_t *values, size_t n, int bits, std::vector<unsigned char> &out)
+{
+    uint32_t mask = lowMask(bits);
+    uint64_t acc = 0;
+    int filled = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        acc |= static_cast<uint64_t>(values[i] & mask) << filled;
+        filled += bits;
+        while (filled >= 8)
+        {
+            out.push_back(static_cast<unsigned char>(acc));
+            acc >>= 8;
+            filled -= 8;
+        }
+    }
+    if (filled > 0)
+    {
+        out.push_back(static_cast<unsigned char>(acc));
+    }
+}
+
+inline const unsigned char *unpackBits(const unsigned char *in, size_t n, int bits, uint32_t *out)
+{
+    if (bits == 0)
+    {
+        memset(out, 0, n * sizeof(uint32_t));
+        return in;
+    }
+    uint32_t mask = lowMask(bits);
+    uint64_t acc = 0;
+    int filled = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        while (filled < bits)
+        {
+            acc |= static_cast<uint64_t>(*in++) << filled;
+            filled += 8;
+        }
+        out[i] = static_cast<uint32_t>(acc) & mask;
+        acc >>= bits;
+        filled -= bits;
+    }
+    return in;
+}
+
+// ENCODERS, append one block part to out
+inline void encodeVarbyte(const uint32_t *values, size_t n, std::vector<unsigned char> &out)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        varbyteEncode(out, values[i]);
+    }
+}
+
+inline void encodeBitpack(const uint32_t *values, size_t n, std::vector<unsigned char> &out)
+{
+    uint32_t all = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        all |= values[i];
+    }
+    int bits = bitsNeeded(all);
+    out.push_back(static_cast<unsigned char>(n));
+    out.push_back(static_cast<unsigned char>(bits));
+    packBits(values, n, bits, out);
+}
+
+inline void encodePFor(const uint32_t *values, size_t n, std::vector<unsigned char> &out)
+{
+    // histogram of value widths, then pick the width that minimizes packed bytes + exception bytes
+    size_t widthCount[33] = {0};
+    for (size_t i = 0; i < n; ++i)
+    {
+        ++widthCount[bitsNeeded(values[i])];
+    }
+    int bestBits = 32;
+    size_t bestCost = SIZE_MAX;
+    for (int bits = 0; bits <= 32; ++bits)
+    {
+        size_t cost = (n * bits + 7) / 8;
+        for (int width = bits + 1; width <= 32; ++width)
+        {
+            cost += widthCount[width] * (1 + (width - bits + 6) / 7); // position byte + varbyte of the high bits
+        }
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            bestBits = bits;
+        }
+    }
+
+    uint32_t mask = lowMask(bestBits);
+    size_t exceptionCount = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        exceptionCount += values[i] > mask;
+    }
+    out.push_back(static_cast<unsigned char>(n));
+    out.push_back(static_cast<unsigned char>(bestBits));
+    out.push_back(static_cast<unsigned char>(exceptionCount));
+    packBits(values, n, bestBits, out);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (values[i] > mask)
+        {
+            out.push_back(static_cast<unsigned char>(i));
+            varbyteEncode(out, values[i] >> bestBits);
+        }
+    }
+}
+
+inline int streamVByteLengthCode(uint32_t value)
+{
+    return value < (1u << 8) ? 0 : value < (1u << 16) ? 1 : value < (1u << 24) ? 2 : 3;
+}
+
+inline void encodeStreamVByte(const uint32_t *values, size_t n, std::vector<unsigned char> &out)
+{
+    out.push_back(static_cast<unsigned char>(n));
+    size_t controlStart = out.size();
+    out.resize(controlStart + (n + 3) / 4, 0);
+    for (size_t i = 0; i < n; ++i)
+    {
+        int code = streamVByteLengthCode(values[i]);
+        out[controlStart + i / 4] |= code << (2 * (i % 4));
+        for (int byte = 0; byte <= code; ++byte)
+        {
+            out.push_back(static_cast<unsigned char>(values[i] >> (8 * byte)));
+        }
+    }
+}
+
+inline void encodeBlockPart(int codec, const uint32_t *values, size_t n, std::vector<unsigned char> &out)
+{
+    switch (codec)
+    {
+    case CODEC_BITPACK:
+        encodeBitpack(values, n, out);
+        break;
+    case CODEC_PFOR:
+        encodePFor(values, n, out);
+        break;
+    case CODEC_STREAMVBYTE:
+        encodeStreamVByte(values, n, out);
+        break;
+    default:
+        encodeVarbyte(values, n, out);
+        break;
+    }
+}
+
+// DECODERS, decode one block part of `size` bytes into out (room for 128 values), return the number of values
+#if defined(__SSSE3__)
+// Masked VByte: the continuation bits of the next 12 bytes select how many whole values (up to 4, at most 4 bytes each)
+// start there, the shuffle that moves each value's bytes into its own 32-bit lane, and how many bytes they take
+struct MaskedVByteTables
+{
+    alignas(16) uint8_t shuffle[4096][16];
+    uint8_t count[4096];    // values decoded, 0 = fall back to scalar for one value
+    uint8_t consumed[4096]; // bytes used by those values
+
+    MaskedVByteTables()
+    {
+        for (int mask = 0; mask < 4096; ++mask)
+        {
+            memset(shuffle[mask], 0xFF, 16); // 0xFF zeroes the byte
+            int pos = 0;
+            int values = 0;
+            while (values < 4)
+            {
+                int len = 1;
+                while (pos + len - 1 < 12 && (mask >> (pos + len - 1)) & 1)
+                {
+                    ++len;
+                }
+                if (pos + len > 12 || len > 4)
+                {
+                    break; // value not complete in these 12 bytes, or too wide for a lane
+                }
+                for (int byte = 0; byte < len; ++byte)
+                {
+                    shuffle[mask][4 * values + byte] = pos + byte;
+                }
+                pos += len;
+                ++values;
+            }
+            count[mask] = values;
+            consumed[mask] = pos;
+        }
+    }
+};
+
+inline const MaskedVByteTables &maskedVByteTables()
+{
+    static const MaskedVByteTables tables;
+    return tables;
+}
+#endif
+
+inline size_t decodeVarbyte(const unsigned char *in, size_t size, uint32_t *out)
+{
+    const unsigned char *end = in + size;
+    size_t n = 0;
+#if defined(__SSSE3__)
+    const MaskedVByteTables &tables = maskedVByteTables();
+    const __m128i low7 = _mm_set1_epi32(0x7F);
+    while (end - in >= 16)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+        int mask = _mm_movemask_epi8(x) & 0xFFF;
+        int count = tables.count[mask];
+        if (count == 0)
+        {
+            in = varbyteDecode(in, out[n++]); // 5 byte value
+            continue;
+        }
+
+        // bytes of each value into its lane, then drop the continuation bits and close the 7-bit gaps
+        __m128i y = _mm_shuffle_epi8(x, _mm_load_si128(reinterpret_cast<const __m128i *>(tables.shuffle[mask])));
+        __m128i v = _mm_and_si128(y, low7);
+        v = _mm_or_si128(v, _mm_and_si128(_mm_srli_epi32(y, 1), _mm_slli_epi32(low7, 7)));
+        v = _mm_or_si128(v, _mm_and_si128(_mm_srli_epi32(y, 2), _mm_slli_epi32(low7, 14)));
+        v = _mm_or_si128(v, _mm_and_si128(_mm_srli_epi32(y, 3), _mm_slli_epi32(low7, 21)));
+        if (n + 4 <= BLOCK_CODEC_MAX_VALUES)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + n), v);
+        }
+        else
+        {
+            alignas(16) uint32_t lanes[4];
+            _mm_store_si128(reinterpret_cast<__m128i *>(lanes), v);
+            memcpy(out + n, lanes, count * sizeof(uint32_t));
+        }
+        n += count;
+        in += tables.consumed[mask];
+    }
+#endif
+    while (in < end)
+    {
+        in = varbyteDecode(in, out[n++]);
+    }
+    return n;
+}
+
+// bytes of the header plus n values of `bits` bits, the part must fit in size or it is corrupt
+inline bool packedFits(size_t header, size_t n, int bits, size_t size)
+{
+    return size >= header && n <= BLOCK_CODEC_MAX_VALUES && bits <= 32 && header + (n * bits + 7) / 8 <= size;
+}
+
+// the size checks below keep a corrupt block part from reading or writing out of bounds, it decodes to no values
+inline size_t decodeBitpack(const unsigned char *in, size_t size, uint32_t *out)
+{
+    if (!packedFits(2, in[0], in[1], size))
+    {
+        return 0;
+    }
+    size_t n = in[0];
+    unpackBits(in + 2, n, in[1], out);
+    return n;
+}
+
+inline size_t decodePFor(const unsigned char *in, size_t size, uint32_t *out)
+{
+    if (!packedFits(3, in[0], in[1], size))
+    {
+        return 0;
+    }
+    size_t n = in[0];
+    int bits = in[1];
+    size_t exceptionCount = in[2];
+    const unsigned char *ptr = unpackBits(in + 3, n, bits, out);
+    const unsigned char *end = in + size;
+
+    // patch the values that did not fit in `bits`, each exception is at least 2 bytes
+    for (size_t e = 0; e < exceptionCount; ++e)
+    {
+        if (end - ptr < 2 || *ptr >= n)
+        {
+            return 0;
+        }
+        uint32_t pos = *ptr++;
+        uint32_t high;
+        ptr = varbyteDecode(ptr, high);
+        out[pos] |= high << bits;
+    }
+    return n;
+}
+
+#if defined(__SSSE3__)
+// shuffle mask and data length for every control byte
+struct StreamVByteTables
+{
+    alignas(16) uint8_t shuffle[256][16];
+    uint8_t length[256];
+
+    StreamVByteTables()
+    {
+        for (int control = 0; control < 256; ++control)
+        {
+            int offset = 0;
+            for (int value = 0; value < 4; ++value)
+            {
+                int bytes = ((control >> (2 * value)) & 3) + 1;
+                for (int byte = 0; byte < 4; ++byte)
+                {
+                    shuffle[control][4 * value + byte] = byte < bytes ? offset + byte : 0xFF; // 0xFF zeroes the byte
+                }
+                offset += bytes;
+            }
+            length[control] = offset;
+        }
+    }
+};
+
+inline const StreamVByteTables &streamVByteTables()
+{
+    static const StreamVByteTables tables;
+    return tables;
+}
+#endif
+
+inline size_t decodeStreamVByte(const unsigned char *in, size_t size, uint32_t *out)
+{
+    size_t n = in[0];
+    if (n > BLOCK_CODEC_MAX_VALUES || 1 + (n + 3) / 4 > size)
+    {
+        return 0;
+    }
+    const unsigned char *control = in + 1;
+    const unsigned char *data = control + (n + 3) / 4;
+    const unsigned char *end = in + size;
+
+    size_t i = 0;
+#if defined(__SSSE3__)
+    // 4 values per control byte with one unaligned load + shuffle, as long as 16 bytes can be loaded inside the block
+    const StreamVByteTables &tables = streamVByteTables();
+    for (; i + 4 <= n && end - data >= 16; i += 4)
+    {
+        uint8_t c = control[i / 4];
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+        __m128i mask = _mm_load_si128(reinterpret_cast<const __m128i *>(tables.shuffle[c]));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_shuffle_epi8(x, mask));
+        data += tables.length[c];
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        int bytes = ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+        if (end - data < bytes)
+        {
+            return 0;
+        }
+        uint32_t value = 0;
+        for (int byte = 0; byte < bytes; ++byte)
+        {
+            value |= static_cast<uint32_t>(data[byte]) << (8 * byte);
+        }
+        data += bytes;
+        out[i] = value;
+    }
+    return n;
+}
+
+// gaps -> running sums in place, 4 lanes per step with SSE2
+inline void prefixSum(uint32_t *values, size_t n)
+{
+    size_t i = 0;
+    uint32_t prev = 0;
+#if defined(__SSE2__)
+    __m128i carry = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(values + i));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi32(x, carry);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(values + i), x);
+        carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    if (i > 0)
+    {
+        prev = values[i - 1];
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        prev += values[i];
+        values[i] = prev;
+    }
+}
+
+inline size_t decodeBlockPart(int codec, const unsigned char *in, size_t size, uint32_t *out)
+{
+    if (size == 0)
+    {
+        return 0;
+    }
+    switch (codec)
+    {
+    case CODEC_BITPACK:
+        return decodeBitpack(in, size, out);
+    case CODEC_PFOR:
+        return decodePFor(in, size, out);
+    case CODEC_STREAMVBYTE:
+        return decodeStreamVByte(in, size, out);
+    default:
+        return decodeVarbyte(in, size, out);
+    }
+}
@@ -0,0 +1,331 @@
+#pragma once
+
+// sorted, front-coded term dictionary that is binary searched in place, straight out of a memory mapping
+// (or an in-memory image of the same bytes), so opening it builds no per-term strings or hash tables
+// used for lexicon.bin.fc (LexiconEntry, written next to lexicon.bin by IndexWriter) and impact_lexicon.bin (ImpactLexiconEntry)
+//
+// layout:
+//   FrontCodedHeader
+//   termCount x Entry      in term order, a term's index is the index of its entry
+//   bucketCount x uint64   offset of every bucket in the term area (8-byte aligned)
+//   term area              buckets of FRONT_CODED_BUCKET_SIZE terms: the first as varbyte length + bytes,
+//                          the others as varbyte shared prefix length, varbyte suffix length, suffix bytes
+//   extra bytes            payload the entries point into (inline postings of the main lexicon)
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include "tokenizer.h" // MappedFile
+
+const uint32_t FRONT_CODED_MAGIC = 0x4C434346; // "FCCL"
+const uint32_t FRONT_CODED_VERSION = 1;
+const uint32_t FRONT_CODED_BUCKET_SIZE = 16;
+
+struct FrontCodedHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entrySize; // sizeof(Entry), catches a lexicon opened with the wrong entry type
+    uint32_t bucketSize;
+    uint64_t termCount;
+    uint64_t bucketCount;
+    uint64_t termBytes;
+    uint64_t extraBytes;
+};
+
+inline size_t frontCodedBucketsStart(uint64_t termCount, size_t entrySize)
+{
+    size_t start = sizeof(FrontCodedHeader) + termCount * entrySize;
+    return (start + 7) & ~static_cast<size_t>(7);
+}
+
+inline const unsigned char *frontCodedVarbyte(const unsigned char *in, uint32_t &num)
+{
+    num = 0;
+    uint32_t shift = 0;
+    while (*in >= 128)
+    {
+        num |= static_cast<uint32_t>(*in++ & 127) << shift;
+        shift += 7;
+    }
+    num |= static_cast<uint32_t>(*in++) << shift;
+    return in;
+}
+
+// takes terms in sorted order, builds the whole image in memory and writes it at the end
+template <typename Entry>
+class FrontCodedLexiconWriter
+{
+public:
+    void add(const char *term, size_t termLen, const Entry &entry)
+    {
+        if (entries.size() % FRONT_CODED_BUCKET_SIZE == 0)
+        {
+            bucketOffsets.push_back(terms.size());
+            appendVarbyte(termLen);
+            prevTerm.clear();
+        }
+        else
+        {
+            size_t shared = 0;
+            size_t maxShared = std::min(prevTerm.size(), termLen);
+            while (shared < maxShared && prevTerm[shared] == term[shared])
+            {
+                ++shared;
+            }
+            appendVarbyte(shared);
+            appendVarbyte(termLen - shared);
+            term += shared;
+            termLen -= shared;
+            prevTerm.resize(shared);
+        }
+        terms.insert(terms.end(), term, term + termLen);
+        prevTerm.append(term, termLen);
+        entries.push_back(entry);
+    }
+
+    // payload bytes the entries can point into, an entry stores the offset it got from extra().size()
+    std::vector<unsigned char> &extra()
+    {
+        return extraBytes;
+    }
+
+    size_t size() const
+    {
+        return entries.size();
+    }
+
+    void build(std::vector<char> &image) const
+    {
+        FrontCodedHeader header{FRONT_CODED_MAGIC, FRONT_CODED_VERSION, sizeof(Entry), FRONT_CODED_BUCKET_SIZE,
+                                entries.size(), bucketOffsets.size(), terms.size(), extraBytes.size()};
+        size_t bucketsStart = frontCodedBucketsStart(entries.size(), sizeof(Entry));
+        size_t termsStart = bucketsStart + bucketOffsets.size() * sizeof(uint64_t);
+        image.assign(termsStart + terms.size() + extraBytes.size(), 0);
+        memcpy(image.data(), &header, sizeof(header));
+        if (!entries.empty())
+        {
+            memcpy(image.data() + sizeof(header), entries.data(), entries.size() * sizeof(Entry));
+            memcpy(image.data() + bucketsStart, bucketOffsets.data(), bucketOffsets.size() * sizeof(uint64_t));
+            memcpy(image.data() + termsStart, terms.data(), terms.size());
+        }
+        if (!extraBytes.empty())
+        {
+            memcpy(image.data() + termsStart + terms.size(), extraBytes.data(), extraBytes.size());
+        }
+    }
+
+    // returns bytes written, 0 on failure
+    uint64_t write(const std::string &filename) const
+    {
+        std::vector<char> image;
+        build(image);
+        std::ofstream ofs(filename, std::ios::binary);
+        ofs.write(image.data(), image.size());
+        return ofs ? image.size() : 0;
+    }
+
+private:
+    void appendVarbyte(size_t value)
+    {
+        uint32_t num = static_cast<uint32_t>(value);
+        while (num >= 128)
+        {
+            terms.push_back(static_cast<unsigned char>(128 + (num & 127)));
+            num >>= 7;
+        }
+        terms.push_back(static_cast<unsigned char>(num));
+    }
+
+    std::vector<Entry> entries;
+    std::vector<uint64_t> bucketOffsets;
+    std::vector<unsigned char> terms;
+    std::vector<unsigned char> extraBytes;
+    std::string prevTerm;
+};
+
+// read side: open() maps the file, load() takes an image built in memory (e.g. converted from an older format),
+// attach() uses bytes that are already mapped
+template <typename Entry>
+class FrontCodedLexicon
+{
+public:
+    bool open(const std::string &filename)
+    {
+        if (!file.open(filename, MADV_RANDOM))
+        {
+            return false;
+        }
+        return attach(reinterpret_cast<const unsigned char *>(file.data), file.size);
+    }
+
+    bool load(std::vector<char> &&bytes)
+    {
+        image = std::move(bytes);
+        return attach(reinterpret_cast<const unsigned char *>(image.data()), image.size());
+    }
+
+    // term index of term, false if it is not in the lexicon
+    bool find(const char *term, size_t termLen, size_t &index) const
+    {
+        if (bucketCount == 0)
+        {
+            return false;
+        }
+
+        // last bucket whose first term is <= term
+        size_t lo = 0;
+        size_t hi = bucketCount;
+        while (hi - lo > 1)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            uint32_t len;
+            const unsigned char *first = frontCodedVarbyte(bucketStart(mid), len);
+            if (compare(first, len, term, termLen) <= 0)
+                lo = mid;
+            else
+                hi = mid;
+        }
+
+        // walk the bucket, rebuilding each term from the previous one
+        const unsigned char *in = bucketStart(lo);
+        size_t bucketEnd = std::min<uint64_t>((lo + 1) * bucketSize, termCount);
+        std::string current;
+        for (size_t i = lo * bucketSize; i < bucketEnd; ++i)
+        {
+            uint32_t shared = 0;
+            uint32_t suffixLen;
+            if (i != lo * bucketSize)
+            {
+                in = frontCodedVarbyte(in, shared);
+            }
+            in = frontCodedVarbyte(in, suffixLen);
+            current.resize(shared);
+            current.append(reinterpret_cast<const char *>(in), suffixLen);
+            in += suffixLen;
+
+            int cmp = compare(reinterpret_cast<const unsigned char *>(current.data()), current.size(), term, termLen);
+            if (cmp == 0)
+            {
+                index = i;
+                return true;
+            }
+            if (cmp > 0)
+            {
+                break; // sorted, went past it
+            }
+        }
+        return false;
+    }
+
+    bool find(const std::string &term, size_t &index) const
+    {
+        return find(term.data(), term.size(), index);
+    }
+
+    // f(index, term) for every term in order, e.g. to rewrite the lexicon
+    template <typename F>
+    void forEachTerm(F &&f) const
+    {
+        std::string current;
+        const unsigned char *in = terms;
+        for (uint64_t i = 0; i < termCount; ++i)
+        {
+            uint32_t shared = 0;
+            uint32_t suffixLen;
+            if (i % bucketSize != 0)
+            {
+                in = frontCodedVarbyte(in, shared);
+            }
+            in = frontCodedVarbyte(in, suffixLen);
+            current.resize(shared);
+            current.append(reinterpret_cast<const char *>(in), suffixLen);
+            in += suffixLen;
+            f(static_cast<size_t>(i), current);
+        }
+    }
+
+    const Entry &entry(size_t index) const
+    {
+        return entries[index];
+    }
+
+    size_t size() const
+    {
+        return termCount;
+    }
+
+    const unsigned char *extra() const
+    {
+        return extraBytes;
+    }
+
+    uint64_t extraSize() const
+    {
+        return extraCount;
+    }
+
+    // bytes owned by the caller, e.g. a section of a mapped segment (see segment.h)
+    bool attach(const unsigned char *data, size_t size)
+    {
+        FrontCodedHeader header;
+        if (size < sizeof(header))
+        {
+            return false;
+        }
+        memcpy(&header, data, sizeof(header));
+        if (header.magic != FRONT_CODED_MAGIC || header.version != FRONT_CODED_VERSION || header.entrySize != sizeof(Entry))
+        {
+            std::cerr << "Lexicon has an unknown format or version" << std::endl;
+            return false;
+        }
+        size_t bucketsStart = frontCodedBucketsStart(header.termCount, sizeof(Entry));
+        size_t termsStart = bucketsStart + header.bucketCount * sizeof(uint64_t);
+        if (termsStart + header.termBytes + header.extraBytes > size)
+        {
+            std::cerr << "Lexicon is truncated" << std::endl;
+            return false;
+        }
+        termCount = header.termCount;
+        bucketCount = header.bucketCount;
+        bucketSize = header.bucketSize;
+        entries = reinterpret_cast<const Entry *>(data + sizeof(header));
+        bucketOffsets = reinterpret_cast<const uint64_t *>(data + bucketsStart);
+        terms = data + termsStart;
+        extraBytes = terms + header.termBytes;
+        extraCount = header.extraBytes;
+        return true;
+    }
+
+private:
+    const unsigned char *bucketStart(size_t bucket) const
+    {
+        return terms + bucketOffsets[bucket];
+    }
+
+    // byte order, same as the std::string order the terms were sorted in
+    static int compare(const unsigned char *a, size_t aLen, const char *b, size_t bLen)
+    {
+        int cmp = memcmp(a, b, std::min(aLen, bLen));
+        if (cmp != 0)
+        {
+            return cmp;
+        }
+        return aLen < bLen ? -1 : (aLen > bLen ? 1 : 0);
+    }
+
+    MappedFile file;
+    std::vector<char> image;
+    uint64_t termCount = 0;
+    uint64_t bucketCount = 0;
+    uint64_t bucketSize = FRONT_CODED_BUCKET_SIZE;
+    const Entry *entries = nullptr;
+    const uint64_t *bucketOffsets = nullptr;
+    const unsigned char *terms = nullptr;
+    const unsigned char *extraBytes = nullptr;
+    uint64_t extraCount = 0;
+};
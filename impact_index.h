@@ -0,0 +1,178 @@
+#pragma once
+
+// quantized impact-ordered index, written by `index --impact` and read by `querying --traversal saat`
+//
+// every posting's BM25 score (idf from the list length and the page table's doc count, frequency part from the page table)
+// is computed at build time and quantized to 8 bits: impact = round(score / impactScoreBound(N) * 255), at least 1,
+// postings with score <= 0 are dropped
+// impact_index.bin: per term, its postings grouped into segments of equal impact, highest impact first:
+//   uint8 impact, varbyte postingCount, varbyte byteCount, byteCount bytes of postingCount x varbyte docId gap
+//   (increasing docIds, gaps restart in every segment), so a query finds every segment from the headers alone
+// impact_lexicon.bin: front-coded lexicon of ImpactLexiconEntry (see front_coded_lexicon.h)
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "index_writer.h" // BM25 helpers, loadDocLengths, varbyte
+
+struct ImpactLexiconEntry
+{
+    uint64_t offset;       // first segment of the term in impact_index.bin
+    uint32_t size;         // bytes of all the term's segments
+    uint32_t postingCount; // postings stored (without the dropped ones)
+    uint32_t segmentCount;
+    uint32_t maxDocId;     // largest docId stored, lets querying check its accumulators per term instead of per posting
+};
+
+// highest BM25 score any posting can get: idf of a list of length 1 times the limit of the frequency part (k1 + 1)
+inline double impactScoreBound(double docCount)
+{
+    return bm25Idf(1, docCount) * (BM25_K1 + 1);
+}
+
+inline uint8_t quantizeImpact(double score, double docCount)
+{
+    if (score <= 0)
+    {
+        return 0;
+    }
+    long impact = lround(score / impactScoreBound(docCount) * 255);
+    return static_cast<uint8_t>(std::min(255L, std::max(1L, impact)));
+}
+
+// takes postings sorted by (term, docId) one at a time, a term's list is buffered until the term ends since idf needs its length
+class ImpactWriter
+{
+public:
+    bool open(const std::string &indexFile, const std::string &lexiconFile, const std::string &pageTableFile)
+    {
+        if (!loadDocLengths(pageTableFile, docLengths, averageDocLength, &docCount))
+        {
+            return false;
+        }
+        ofs.open(indexFile, std::ios::binary);
+        lexiconFilename = lexiconFile;
+        lexicon = FrontCodedLexiconWriter<ImpactLexiconEntry>();
+        haveTerm = false;
+        written = 0;
+        postingsWritten = 0;
+        return static_cast<bool>(ofs);
+    }
+
+    void add(const char *term, size_t termLen, uint32_t docId, uint32_t freq)
+    {
+        if (!haveTerm || termLen != currentTerm.size() || memcmp(term, currentTerm.data(), termLen) != 0)
+        {
+            finishTerm();
+            currentTerm.assign(term, termLen);
+            haveTerm = true;
+        }
+        docIds.push_back(docId);
+        freqs.push_back(freq);
+    }
+
+    void close()
+    {
+        finishTerm();
+        ofs.close();
+        lexicon.write(lexiconFilename);
+    }
+
+    uint64_t bytesWritten() const
+    {
+        return written;
+    }
+
+    uint64_t postingCount() const
+    {
+        return postingsWritten;
+    }
+
+private:
+    void finishTerm()
+    {
+        if (!haveTerm)
+        {
+            return;
+        }
+
+        // score and quantize every posting of the term
+        double idf = bm25Idf(docIds.size(), docCount);
+        order.clear();
+        impacts.resize(docIds.size());
+        for (size_t i = 0; i < docIds.size(); ++i)
+        {
+            double docLength = docIds[i] < docLengths.size() ? docLengths[docIds[i]] : 0;
+            impacts[i] = quantizeImpact(idf * bm25FrequencyPart(freqs[i], docLength, averageDocLength), docCount);
+            if (impacts[i] > 0)
+            {
+                order.push_back(i);
+            }
+        }
+        // highest impact first, docIds stay increasing within an impact
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+                         { return impacts[a] > impacts[b]; });
+
+        buffer.clear();
+        ImpactLexiconEntry entry{written, 0, static_cast<uint32_t>(order.size()), 0, 0};
+        size_t i = 0;
+        while (i < order.size())
+        {
+            uint8_t impact = impacts[order[i]];
+            size_t end = i;
+            while (end < order.size() && impacts[order[end]] == impact)
+            {
+                ++end;
+            }
+            // gaps first, the header needs their byte count
+            gapBuffer.clear();
+            uint32_t prevDocId = 0;
+            for (size_t j = i; j < end; ++j)
+            {
+                varbyteEncode(gapBuffer, docIds[order[j]] - prevDocId);
+                prevDocId = docIds[order[j]];
+            }
+            writeByte(buffer, impact);
+            varbyteEncode(buffer, static_cast<uint32_t>(end - i));
+            varbyteEncode(buffer, static_cast<uint32_t>(gapBuffer.size()));
+            buffer.insert(buffer.end(), gapBuffer.begin(), gapBuffer.end());
+            entry.maxDocId = std::max(entry.maxDocId, prevDocId);
+            ++entry.segmentCount;
+            i = end;
+        }
+        entry.size = static_cast<uint32_t>(buffer.size());
+        ofs.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+        written += buffer.size();
+        postingsWritten += order.size();
+
+        lexicon.add(currentTerm.data(), currentTerm.size(), entry);
+
+        docIds.clear();
+        freqs.clear();
+        haveTerm = false;
+    }
+
+    std::ofstream ofs;
+    FrontCodedLexiconWriter<ImpactLexiconEntry> lexicon;
+    std::string lexiconFilename;
+
+    std::vector<uint32_t> docLengths; // indexed by docId
+    double averageDocLength = 0;
+    uint64_t docCount = 0; // BM25's N
+
+    std::string currentTerm;
+    std::vector<uint32_t> docIds; // postings of currentTerm
+    std::vector<uint32_t> freqs;
+    std::vector<uint8_t> impacts;
+    std::vector<uint32_t> order; // postings kept, by impact
+    std::vector<unsigned char> buffer;
+    std::vector<unsigned char> gapBuffer; // one segment's gaps
+    bool haveTerm = false;
+    uint64_t written = 0; // bytes of impact_index.bin
+    uint64_t postingsWritten = 0;
+};
@@ -3,10 +3,12 @@
 #include <vector>
 #include <string>
 #include <chrono>
+#include "run_format.h"
+#include "index_writer.h"
+#include "impact_index.h"
+#include "segment.h"
 using namespace std;
 
-const int MAX_BUF_POSTINGS = 128;
-
 struct PostingEntry
 {
     string term;
@@ -14,230 +16,205 @@ struct PostingEntry
     int freq;
 };
 
-struct BlockMetadata
-{
-    uint32_t lastDocId;
-    uint32_t docSize;  // compressed doc size
-    uint32_t freqSize; // compressed freq size
-};
-
-struct LexiconEntry
+// INVERTED INDEX + LEXICON
+// merged postings are streamed in the compact run format (see run_format.h)
+bool readNextRecord(RunReader &reader, PostingEntry &p)
 {
-    uint32_t startBlock; // which block term starts in
-    uint32_t startIndex; // which index within block term start (0-127)
-    uint32_t listLength; // total postings for the term
-};
-
-struct Block
-{ // each of size 128 docIds, and 128 freqs
-
-    vector<int> docIds;
-    vector<int> freqs; // freq for corresponding docIds
-
-    void clear()
+    if (!reader.next())
     {
-        docIds.clear();
-        freqs.clear();
+        return false;
     }
-};
 
-// VARBYTE ENCODING
-void writeByte(vector<unsigned char> &buffer, uint8_t val) // 8 byte num
-{
-    buffer.push_back(val);
+    // only copy the term when it changes
+    if (reader.term() != p.term)
+    {
+        p.term = reader.term();
+    }
+    p.docId = reader.docId;
+    p.freq = reader.freq;
+    return true;
 }
 
-void varbyteEncode(vector<unsigned char> &buffer, uint32_t num)
+// merged files in term order: one final_merged.bin, or the segments of a parallel merge
+// falls back to final_merged.bin when there is no manifest
+vector<string> loadMergedFiles(const string &manifestFile)
 {
-    while (num >= 128)
+    vector<string> filenames;
+    ifstream ifs(manifestFile);
+    string line;
+    while (getline(ifs, line))
     {
-        writeByte(buffer, 128 + (num & 127)); // set the 1 and then the next 7 bits
-        num >>= 7;                            // right shift by 7 bits
+        if (!line.empty())
+        {
+            filenames.push_back(line);
+        }
     }
-    writeByte(buffer, static_cast<uint8_t>(num)); // without the 1 bit at the front
+    if (filenames.empty())
+    {
+        filenames.push_back("final_merged.bin");
+    }
+    return filenames;
 }
 
-// INVERTED INDEX + LEXICON
-bool readNextRecord(ifstream &ifs, PostingEntry &p)
+// blocking, compression, lexicon and metadata are done by IndexWriter (see index_writer.h)
+void generateInvertedIndex(int codec, bool termAligned)
 {
-    uint32_t termLen;
-    if (!ifs.read(reinterpret_cast<char *>(&termLen), sizeof(termLen)))
+    vector<string> inFilenames = loadMergedFiles("merged.manifest");
+    string outFilename = "compressed_inverted_index.bin";
+    string lexiconFilename = "lexicon.bin";
+    string metadataFilename = "metadata.bin";
+
+    IndexWriter writer;
+    writer.setCodec(codec);
+    writer.setTermAligned(termAligned);
+    if (!writer.open(outFilename, lexiconFilename, metadataFilename))
     {
-        return false;
+        cerr << "Failed to open index output files" << endl;
+        exit(1);
     }
-    if (termLen == 0)
+    // per-block and per-term score bounds for block-max query processing
+    if (!writer.setMaxScores("max_scores.bin", "page_table.txt"))
     {
-        return false;
+        cerr << "No page_table.txt, max_scores.bin not written" << endl;
     }
 
-    string term(termLen, '\0');
-    if (!ifs.read(&term[0], termLen))
+    // segments cover disjoint, increasing term ranges, so reading them in order is one sorted stream
+    PostingEntry p;
+    for (const string &inFilename : inFilenames)
     {
-        return false;
+        RunReader reader;
+        if (!reader.open(inFilename))
+        {
+            cerr << "Failed to open " << inFilename << endl;
+            exit(1);
+        }
+        while (readNextRecord(reader, p))
+        {
+            writer.add(p.term.data(), p.term.size(), p.docId, p.freq);
+        }
+        reader.close();
     }
 
-    int docId, freq;
-    if (!ifs.read(reinterpret_cast<char *>(&docId), sizeof(docId)))
-    {
-        return false;
-    }
-    if (!ifs.read(reinterpret_cast<char *>(&freq), sizeof(freq)))
+    writer.close();
+
+    for (int part = 0; part < 2; ++part)
     {
-        return false;
+        cout << (part == 0 ? "docId" : "freq") << " blocks per codec:";
+        for (int c = 0; c < CODEC_COUNT; ++c)
+        {
+            cout << " " << codecName(c) << "=" << writer.codecUse(part, c);
+        }
+        cout << endl;
     }
-
-    p = PostingEntry{term, docId, freq};
-    return true;
 }
 
-void writeLexiconEntry(ofstream &ofs, const string &term, LexiconEntry &entry)
+// impact-ordered index for score-at-a-time querying (see impact_index.h), written instead of the blocked index
+void generateImpactIndex()
 {
-    uint32_t termSize = term.size();
-    ofs.write(reinterpret_cast<char *>(&termSize), sizeof(termSize));
-    ofs.write(term.data(), termSize);
-    ofs.write(reinterpret_cast<char *>(&entry), sizeof(LexiconEntry));
-}
+    vector<string> inFilenames = loadMergedFiles("merged.manifest");
 
-// compress 1 block of docIDs and 1 block of freqs
-// append metadata
-// increment blockCount
-void compressBlock(ofstream &ofs, const Block &block, vector<unsigned char> &buffer, vector<BlockMetadata> &metadata, uint32_t &blockCount)
-{
-    buffer.clear();
-    // compress and write docIds
-    // use delta then varbyte !!
-    int prevDocId = 0;
-    for (int docId : block.docIds)
+    ImpactWriter writer;
+    if (!writer.open("impact_index.bin", "impact_lexicon.bin", "page_table.txt"))
     {
-        uint32_t delta = docId - prevDocId;
-        varbyteEncode(buffer, delta);
-        prevDocId = docId;
+        cerr << "Failed to open impact index output files or page_table.txt" << endl;
+        exit(1);
     }
-    // write to output buffer
-    ofs.write(reinterpret_cast<char *>(buffer.data()), buffer.size());
-    uint32_t lastDocId = static_cast<uint32_t>(block.docIds.back());
-    uint32_t docByteCount = static_cast<uint32_t>(buffer.size());
-    buffer.clear();
-
-    // compress and write freqs
-    for (int freq : block.freqs)
+
+    PostingEntry p;
+    for (const string &inFilename : inFilenames)
     {
-        varbyteEncode(buffer, static_cast<uint32_t>(freq));
+        RunReader reader;
+        if (!reader.open(inFilename))
+        {
+            cerr << "Failed to open " << inFilename << endl;
+            exit(1);
+        }
+        while (readNextRecord(reader, p))
+        {
+            writer.add(p.term.data(), p.term.size(), p.docId, p.freq);
+        }
+        reader.close();
     }
-    ofs.write(reinterpret_cast<char *>(buffer.data()), buffer.size());
-    uint32_t freqByteCount = static_cast<uint32_t>(buffer.size());
-    buffer.clear();
-
-    // record metadata - one entry per block
-    BlockMetadata blockInfo{lastDocId, docByteCount, freqByteCount};
-    metadata.push_back(blockInfo);
 
-    ++blockCount;
+    writer.close();
+    cout << writer.postingCount() << " postings in " << writer.bytesWritten() << " bytes of impact segments" << endl;
 }
 
-void generateInvertedIndex()
+// everything querying needs in one mapped file (see segment.h), from the index files already on disk
+void packSegment()
 {
-    string inFilename = "final_merged.bin";
-    string outFilename = "compressed_inverted_index.bin";
-    string lexiconFilename = "lexicon.bin";
-    string metadataFilename = "metadata.bin";
-
-    ifstream ifs(inFilename, ios::binary);
-    if (!ifs)
+    uint64_t bytes = writeSegment("index.seg", "compressed_inverted_index.bin", "lexicon.bin", "metadata.bin", "max_scores.bin", "page_table.txt", "doc_ids.bin");
+    if (bytes == 0)
     {
-        cerr << "Failed to open " << inFilename << endl;
+        cerr << "Failed to write index.seg" << endl;
         exit(1);
     }
+    cout << "index.seg: " << bytes << " bytes" << endl;
+}
 
-    // inverted index
-    ofstream ofs(outFilename, ios::binary);
-    ofstream lexicon(lexiconFilename, ios::binary);
-    ofstream metadataOut(metadataFilename, ios::binary);
-
-    string currentTerm;
-    Block block;
-    vector<unsigned char> buffer; // temp buffer for the term docids/freqs
-    vector<BlockMetadata> metadata;
-
-    uint32_t blockCount = 0;       // completed blocks
-    uint32_t termStartBlock = 0;   // block index where current term started
-    uint32_t termStartIndex = 0;   // byte offset within doc-area of block
-    uint32_t termPostingCount = 0; // total postings for current term
-    bool haveOnePosting = false;
+int main(int argc, char *argv[])
+{
+    using namespace std::chrono;
+    auto startTime = high_resolution_clock::now();
 
-    PostingEntry p;
-    while (readNextRecord(ifs, p))
+    // --codec varbyte writes the original format, auto (default) picks the smallest codec per block
+    // --spanning-blocks writes the original layout where blocks run across term boundaries
+    // --impact writes the quantized impact-ordered index instead
+    // --segment also packs the blocked index into index.seg, --segment-only just packs the index files already there
+    //   (e.g. from merging --fused or parsing --in-memory)
+    int codec = CODEC_AUTO;
+    bool termAligned = true;
+    bool impact = false;
+    bool segment = false;
+    bool segmentOnly = false;
+    for (int i = 1; i < argc; ++i)
     {
-        if (!haveOnePosting)
+        string arg = argv[i];
+        if (arg == "--codec" && i + 1 < argc)
         {
-            // first posting ever -> initialize term tracking
-            currentTerm = p.term;
-            termStartBlock = blockCount;
-            termStartIndex = static_cast<uint32_t>(block.docIds.size());
-            termPostingCount = 0;
-            haveOnePosting = true;
+            codec = codecFromName(argv[++i]);
+            if (codec == CODEC_COUNT)
+            {
+                cerr << "Unknown codec " << argv[i] << ", use varbyte, bitpack, pfor, streamvbyte or auto" << endl;
+                return 1;
+            }
         }
-
-        if (p.term != currentTerm) // does not include first ever posting
+        else if (arg == "--spanning-blocks")
         {
-            // new term! prev term finished -> write lexicon entry using termStartBlock/termStartIndex/termPostingCount
-            LexiconEntry entry{termStartBlock, termStartIndex, termPostingCount};
-            writeLexiconEntry(lexicon, currentTerm, entry);
-
-            // reset for new term
-            currentTerm = p.term;
-            termStartBlock = blockCount;
-            termStartIndex = static_cast<uint32_t>(block.docIds.size());
-            termPostingCount = 0;
+            termAligned = false;
         }
-
-        block.docIds.push_back(p.docId);
-        block.freqs.push_back(p.freq);
-        ++termPostingCount;
-
-        // flush block if full
-        if (block.docIds.size() == MAX_BUF_POSTINGS)
+        else if (arg == "--impact")
+        {
+            impact = true;
+        }
+        else if (arg == "--segment")
+        {
+            segment = true;
+        }
+        else if (arg == "--segment-only")
         {
-            // write block
-            compressBlock(ofs, block, buffer, metadata, blockCount);
-            block.clear();
+            segmentOnly = true;
         }
     }
 
-    // final flush
-    if (haveOnePosting)
+    if (segmentOnly)
     {
-        if (!block.docIds.empty())
-        { // still have remaining but not full block
-            compressBlock(ofs, block, buffer, metadata, blockCount);
-            block.clear();
-        }
-
-        // write lexicon for last term
-        LexiconEntry entry{termStartBlock, termStartIndex, termPostingCount};
-        writeLexiconEntry(lexicon, currentTerm, entry);
+        packSegment();
     }
-
-    // write metadata
-    if (!metadata.empty())
+    else if (impact)
     {
-        metadataOut.write(reinterpret_cast<char *>(metadata.data()), metadata.size() * sizeof(BlockMetadata));
+        generateImpactIndex();
+    }
+    else
+    {
+        generateInvertedIndex(codec, termAligned);
+        if (segment)
+        {
+            packSegment();
+        }
     }
-
-    // close files
-    ofs.close();
-    lexicon.close();
-    metadataOut.close();
-}
-
-int main()
-{
-    using namespace std::chrono;
-    auto startTime = high_resolution_clock::now();
-
-    generateInvertedIndex();
 
     auto endTime = high_resolution_clock::now();
     auto duration = duration_cast<milliseconds>(endTime - startTime).count();
     std::cout << "Elapsed time: " << duration << " ms" << std::endl;
-}
\ No newline at end of file
+}
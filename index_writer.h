@@ -0,0 +1,430 @@
+#pragma once
+
+// blocked and compressed inverted index writer, shared by index.cpp (reading final_merged.bin)
+// and the in-memory build in parsing.cpp so both produce the same files
+//
+// compressed_inverted_index.bin: blocks of up to 128 postings, each block is its delta + varbyte docIds followed by its varbyte freqs
+//   (each part encoded with the codec recorded in its BlockMetadata, see block_codec.h)
+//   term-aligned layout (default): every list starts on its own block, so a term's blocks are
+//   metadata[startBlock, startBlock + ceil(listLength / 128)) and their (lastDocId, offset) pairs are the term's skip table
+//   spanning layout (setTermAligned(false), the original format): a block can hold the end of one list and the start of the next
+// metadata.bin: one BlockMetadata per block
+// lexicon.bin.fc: the same entries as a front-coded lexicon searched in place (see front_coded_lexicon.h),
+//   inline postings go to its extra bytes and their entry's startBlock is their offset there
+// lexicon.bin: per term, uint32 term size, term bytes, LexiconEntry
+//   term-aligned lists of at most INLINE_MAX_POSTINGS postings have no block, their entry has startIndex == INLINE_LIST,
+//   startBlock = byte count of the inline postings that follow it (varbyte docId gap, varbyte freq pairs)
+// max_scores.bin (only with setMaxScores): one float per block, then one float per lexicon entry,
+//   the largest BM25 frequency part of the block's / term's postings rounded up, times the term's idf it bounds its scores
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
+#include "block_codec.h"
+#include "front_coded_lexicon.h"
+
+const int MAX_BUF_POSTINGS = 128;
+
+struct BlockMetadata
+{
+    uint32_t lastDocId;
+    uint32_t docSize;  // compressed doc size in the low 24 bits, doc codec in bits 24-27, freq codec in bits 28-31
+    uint32_t freqSize; // compressed freq size
+};
+
+const uint32_t BLOCK_SIZE_MASK = 0x00FFFFFF;
+
+inline uint32_t blockDocSize(const BlockMetadata &block)
+{
+    return block.docSize & BLOCK_SIZE_MASK;
+}
+
+inline int blockDocCodec(const BlockMetadata &block)
+{
+    return (block.docSize >> 24) & 15;
+}
+
+inline int blockFreqCodec(const BlockMetadata &block)
+{
+    return block.docSize >> 28;
+}
+
+struct LexiconEntry
+{
+    uint32_t startBlock; // which block term starts in
+    uint32_t startIndex; // which index within block term start (0-127)
+    uint32_t listLength; // total postings for the term
+};
+
+const uint32_t INLINE_LIST = UINT32_MAX; // LexiconEntry::startIndex of a list stored in the lexicon
+const uint32_t INLINE_MAX_POSTINGS = 4;
+
+inline bool isInlineList(const LexiconEntry &entry)
+{
+    return entry.startIndex == INLINE_LIST;
+}
+
+// BM25 parameters shared by the index build (max scores, impacts) and querying,
+// N is the doc count of the page table (index.seg keeps it in its header), so idf fits the collection that was parsed
+const double BM25_K1 = 1.2;
+const double BM25_B = 0.75;
+
+// negative for terms in more than half the docs, score bounds clamp it to 0
+inline double bm25Idf(uint32_t listLength, double docCount)
+{
+    double logNum = docCount - listLength + 0.5;
+    double logDenom = listLength + 0.5;
+    return log(logNum / logDenom);
+}
+
+// the part of a BM25 term score that depends on the posting, querying multiplies it by the term's idf
+inline double bm25FrequencyPart(uint32_t freq, double docLength, double averageDocLength)
+{
+    double normalized_doc = docLength / averageDocLength;
+    double big_k = BM25_K1 * ((1 - BM25_B) + (BM25_B * normalized_doc));
+    double num = (BM25_K1 + 1) * freq;
+    double denom = big_k + freq;
+    return num / denom;
+}
+
+// doc lengths by docId from the page table (docId, docLength per line) written by parsing,
+// same average as querying: total length over the number of docs, docCount (BM25's N) is the number of lines
+inline bool loadDocLengths(const std::string &pageTableFile, std::vector<uint32_t> &docLengths, double &averageDocLength,
+                           uint64_t *docCountOut = nullptr)
+{
+    std::ifstream pageTable(pageTableFile);
+    if (!pageTable)
+    {
+        return false;
+    }
+    docLengths.clear();
+    uint64_t totalLength = 0;
+    uint64_t docCount = 0;
+    int docId, docLength;
+    while (pageTable >> docId >> docLength)
+    {
+        if (static_cast<size_t>(docId) >= docLengths.size())
+        {
+            docLengths.resize(docId + 1, 0);
+        }
+        docLengths[docId] = docLength;
+        totalLength += docLength;
+        ++docCount;
+    }
+    averageDocLength = static_cast<double>(totalLength) / docCount;
+    if (docCountOut)
+    {
+        *docCountOut = docCount;
+    }
+    return true;
+}
+
+inline std::string frontCodedLexiconFile(const std::string &lexiconFile)
+{
+    return lexiconFile + ".fc";
+}
+
+// takes postings sorted by (term, docId) one at a time
+class IndexWriter
+{
+public:
+    bool open(const std::string &indexFile, const std::string &lexiconFile, const std::string &metadataFile)
+    {
+        ofs.open(indexFile, std::ios::binary);
+        lexicon.open(lexiconFile, std::ios::binary);
+        frontCodedFile = frontCodedLexiconFile(lexiconFile);
+        frontCoded = FrontCodedLexiconWriter<LexiconEntry>();
+        metadataOut.open(metadataFile, std::ios::binary);
+        block.clear();
+        metadata.clear();
+        blockCount = 0;
+        written = 0;
+        codecBlocks.assign(2 * CODEC_COUNT, 0);
+        haveOnePosting = false;
+        blockMaxScores.clear();
+        termMaxScores.clear();
+        return ofs && lexicon && metadataOut;
+    }
+
+    // also write max_scores.bin, doc lengths come from the page table
+    // without it an older max_scores.bin is removed, its bounds would not match the new index
+    bool setMaxScores(const std::string &scoresFile, const std::string &pageTableFile)
+    {
+        withMaxScores = loadDocLengths(pageTableFile, docLengths, averageDocLength);
+        if (withMaxScores)
+        {
+            scoresOut.open(scoresFile, std::ios::binary);
+            withMaxScores = static_cast<bool>(scoresOut);
+        }
+        if (!withMaxScores)
+        {
+            std::remove(scoresFile.c_str());
+        }
+        return withMaxScores;
+    }
+
+    void add(const char *term, size_t termLen, uint32_t docId, uint32_t freq)
+    {
+        if (!haveOnePosting || termLen != currentTerm.size() || memcmp(term, currentTerm.data(), termLen) != 0)
+        {
+            // new term! prev term finished -> write lexicon entry using termStartBlock/termStartIndex/termPostingCount
+            finishTerm();
+
+            currentTerm.assign(term, termLen);
+            termStartBlock = blockCount;
+            termStartIndex = static_cast<uint32_t>(block.docIds.size());
+            termPostingCount = 0;
+            haveOnePosting = true;
+        }
+
+        block.docIds.push_back(docId);
+        block.freqs.push_back(freq);
+        ++termPostingCount;
+
+        if (withMaxScores)
+        {
+            double docLength = docId < docLengths.size() ? docLengths[docId] : 0;
+            double score = bm25FrequencyPart(freq, docLength, averageDocLength);
+            blockMaxScore = std::max(blockMaxScore, score);
+            termMaxScore = std::max(termMaxScore, score);
+        }
+
+        // flush block if full
+        if (block.docIds.size() == MAX_BUF_POSTINGS)
+        {
+            compressBlock();
+        }
+    }
+
+    void close()
+    {
+        // still have remaining but not full block, term-aligned blocks are flushed by finishTerm
+        if (!termAligned && !block.docIds.empty())
+        {
+            compressBlock();
+        }
+        finishTerm(); // lexicon for last term
+
+        // write metadata
+        if (!metadata.empty())
+        {
+            metadataOut.write(reinterpret_cast<const char *>(metadata.data()), metadata.size() * sizeof(BlockMetadata));
+            written += metadata.size() * sizeof(BlockMetadata);
+        }
+
+        if (withMaxScores)
+        {
+            scoresOut.write(reinterpret_cast<const char *>(blockMaxScores.data()), blockMaxScores.size() * sizeof(float));
+            scoresOut.write(reinterpret_cast<const char *>(termMaxScores.data()), termMaxScores.size() * sizeof(float));
+            written += (blockMaxScores.size() + termMaxScores.size()) * sizeof(float);
+            scoresOut.close();
+            withMaxScores = false;
+        }
+
+        written += frontCoded.write(frontCodedFile);
+
+        ofs.close();
+        lexicon.close();
+        metadataOut.close();
+    }
+
+    // CODEC_AUTO (default) picks the smallest codec for every block part, CODEC_VARBYTE writes the original format
+    void setCodec(int blockCodec)
+    {
+        codec = blockCodec;
+    }
+
+    // true (default) starts every list on a new block and inlines short lists, false writes the original spanning blocks
+    void setTermAligned(bool aligned)
+    {
+        termAligned = aligned;
+    }
+
+    // how many blocks used each codec for their doc part (part 0) and freq part (part 1)
+    uint64_t codecUse(int part, int blockCodec) const
+    {
+        return codecBlocks[part * CODEC_COUNT + blockCodec];
+    }
+
+    // index + lexicon + metadata bytes, complete after close()
+    uint64_t bytesWritten() const
+    {
+        return written;
+    }
+
+private:
+    struct Block
+    { // each of size 128 docIds, and 128 freqs
+
+        std::vector<uint32_t> docIds;
+        std::vector<uint32_t> freqs; // freq for corresponding docIds
+
+        void clear()
+        {
+            docIds.clear();
+            freqs.clear();
+        }
+    };
+
+    void finishTerm()
+    {
+        if (!haveOnePosting)
+        {
+            return;
+        }
+
+        // term-aligned: the block only holds this term, a short list goes into the lexicon, a longer one closes its last block
+        inlineBuffer.clear();
+        if (termAligned && termPostingCount <= INLINE_MAX_POSTINGS)
+        {
+            uint32_t prevDocId = 0;
+            for (size_t i = 0; i < block.docIds.size(); ++i)
+            {
+                varbyteEncode(inlineBuffer, block.docIds[i] - prevDocId);
+                varbyteEncode(inlineBuffer, block.freqs[i]);
+                prevDocId = block.docIds[i];
+            }
+            block.clear();
+            blockMaxScore = 0; // no block for an inline list, termMaxScore is its only bound
+        }
+        else if (termAligned && !block.docIds.empty())
+        {
+            compressBlock();
+        }
+
+        LexiconEntry entry{termStartBlock, termStartIndex, termPostingCount};
+        if (termAligned && termPostingCount <= INLINE_MAX_POSTINGS)
+        {
+            entry.startBlock = static_cast<uint32_t>(inlineBuffer.size());
+            entry.startIndex = INLINE_LIST;
+        }
+        uint32_t termSize = currentTerm.size();
+        lexicon.write(reinterpret_cast<const char *>(&termSize), sizeof(termSize));
+        lexicon.write(currentTerm.data(), termSize);
+        lexicon.write(reinterpret_cast<const char *>(&entry), sizeof(LexiconEntry));
+        lexicon.write(reinterpret_cast<const char *>(inlineBuffer.data()), inlineBuffer.size());
+        written += sizeof(termSize) + termSize + sizeof(LexiconEntry) + inlineBuffer.size();
+
+        // front-coded copy, inline postings move to its extra bytes
+        if (isInlineList(entry))
+        {
+            entry.startBlock = static_cast<uint32_t>(frontCoded.extra().size());
+            frontCoded.extra().insert(frontCoded.extra().end(), inlineBuffer.begin(), inlineBuffer.end());
+        }
+        frontCoded.add(currentTerm.data(), currentTerm.size(), entry);
+        haveOnePosting = false;
+
+        if (withMaxScores)
+        {
+            termMaxScores.push_back(roundUp(termMaxScore));
+            termMaxScore = 0;
+        }
+    }
+
+    // encode one block part with the configured codec, or with the smallest one, returns the codec used
+    int encodePart(const std::vector<uint32_t> &values, int part)
+    {
+        buffer.clear();
+        int used = codec == CODEC_AUTO ? CODEC_VARBYTE : codec;
+        encodeBlockPart(used, values.data(), values.size(), buffer);
+        if (codec == CODEC_AUTO)
+        {
+            for (int candidate = 1; candidate < CODEC_COUNT; ++candidate)
+            {
+                candidateBuffer.clear();
+                encodeBlockPart(candidate, values.data(), values.size(), candidateBuffer);
+                if (candidateBuffer.size() < buffer.size())
+                {
+                    buffer.swap(candidateBuffer);
+                    used = candidate;
+                }
+            }
+        }
+        ++codecBlocks[part * CODEC_COUNT + used];
+        return used;
+    }
+
+    // compress 1 block of docIDs and 1 block of freqs
+    // append metadata
+    // increment blockCount
+    void compressBlock()
+    {
+        // compress and write docIds
+        // use delta then the block codec !!
+        uint32_t prevDocId = 0;
+        gaps.resize(block.docIds.size());
+        for (size_t i = 0; i < block.docIds.size(); ++i)
+        {
+            gaps[i] = block.docIds[i] - prevDocId;
+            prevDocId = block.docIds[i];
+        }
+        int docCodec = encodePart(gaps, 0);
+        ofs.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+        uint32_t lastDocId = block.docIds.back();
+        uint32_t docByteCount = static_cast<uint32_t>(buffer.size());
+        written += buffer.size();
+
+        // compress and write freqs
+        int freqCodec = encodePart(block.freqs, 1);
+        ofs.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+        uint32_t freqByteCount = static_cast<uint32_t>(buffer.size());
+        written += buffer.size();
+
+        // record metadata - one entry per block
+        docByteCount |= (docCodec << 24) | (freqCodec << 28);
+        metadata.push_back(BlockMetadata{lastDocId, docByteCount, freqByteCount});
+        ++blockCount;
+        block.clear();
+
+        if (withMaxScores)
+        {
+            blockMaxScores.push_back(roundUp(blockMaxScore));
+            blockMaxScore = 0;
+        }
+    }
+
+    // stored bounds must stay above every double score they cover, so never round down to float
+    static float roundUp(double score)
+    {
+        return std::nextafter(static_cast<float>(score), INFINITY);
+    }
+
+    std::ofstream ofs; // inverted index
+    std::ofstream lexicon;
+    std::ofstream metadataOut;
+    std::ofstream scoresOut;
+    FrontCodedLexiconWriter<LexiconEntry> frontCoded;
+    std::string frontCodedFile;
+
+    Block block;
+    std::vector<unsigned char> buffer; // temp buffer for the block docids/freqs
+    std::vector<unsigned char> candidateBuffer; // CODEC_AUTO tries every codec
+    std::vector<uint32_t> gaps;
+    std::vector<unsigned char> inlineBuffer; // postings of an inline list
+    bool termAligned = true;
+    int codec = CODEC_AUTO;
+    std::vector<uint64_t> codecBlocks = std::vector<uint64_t>(2 * CODEC_COUNT, 0);
+    std::vector<BlockMetadata> metadata;
+
+    bool withMaxScores = false;
+    std::vector<uint32_t> docLengths; // indexed by docId
+    double averageDocLength = 0;
+    double blockMaxScore = 0; // largest frequency part in the current block / term
+    double termMaxScore = 0;
+    std::vector<float> blockMaxScores;
+    std::vector<float> termMaxScores;
+
+    std::string currentTerm;
+    uint64_t written = 0;
+    uint32_t blockCount = 0;       // completed blocks
+    uint32_t termStartBlock = 0;   // block index where current term started
+    uint32_t termStartIndex = 0;   // index within block where current term starts
+    uint32_t termPostingCount = 0; // total postings for current term
+    bool haveOnePosting = false;   // a term is in progress
+};
@@ -3,183 +3,683 @@
 #include <fstream>
 #include <string>
 #include <vector>
-#include <queue>
+#include <cstring>
+#include <algorithm>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <cstdio>
+#include <sys/resource.h>
+#include "run_format.h"
+#include "index_writer.h"
 using namespace std;
 
-const size_t BUF_SIZE = 100 * 1024 * 1024; // 100 MB
-const int FILE_COUNT = 16;
+const size_t BUF_SIZE = 100 * 1024 * 1024; // 100 MB, output buffer of a merge
+const size_t DEFAULT_RUN_BUFFER_KB = 1024;   // read buffer per open run
+const size_t DEFAULT_MEMORY_BUDGET_MB = 512; // for all read buffers open at once, decides the fan-in
+const string RUN_MANIFEST = "runs.manifest"; // written by parsing, one run filename per line
+const string MERGED_MANIFEST = "merged.manifest"; // merged files in term order, read by index
+const size_t BATCH_POSTINGS = 64 * 1024; // postings per batch handed from a merge thread to the index writer (--fused)
+const size_t BATCH_QUEUE_DEPTH = 4;
 
-struct PostingEntry
+// GLOBALS
+size_t runBufferSize = DEFAULT_RUN_BUFFER_KB * 1024;
+
+struct MergeStats
 {
-    string term;
-    int docId;
-    int freq;
-    int fileIndex; // original temp file to identify replacement for heap
+    uint64_t bytesRead = 0;
+    uint64_t bytesWritten = 0;
 };
 
-// functor comparator for min-heap
-struct ComparePosting
+// merges the postings of every run whose term falls in [startTerm, endTerm), empty bounds are open
+// runs are kept in a tournament tree of losers: losers[1..k-1] hold the loser of each match, losers[0] the overall winner
+// replacing the winner only replays the matches on its path to the root, log2(k) comparisons with no allocation,
+// terms are compared in place in each reader's term buffer
+struct RangeMerge
 {
-    bool operator()(const PostingEntry &a, const PostingEntry &b) const
+    vector<RunReader> inputFiles;
+    vector<char> live; // run still has a current posting in range
+    vector<int> losers;
+    string startTerm;
+    string endTerm;
+
+    // run a comes before run b: by term, then docId, exhausted runs last
+    bool beats(int a, int b) const
     {
-        if (a.term != b.term)
+        if (!live[a] || !live[b])
         {
-            return a.term > b.term;
+            return live[a] && !live[b];
         }
-        else
+        const RunReader &x = inputFiles[a];
+        const RunReader &y = inputFiles[b];
+        int cmp = x.term().compare(y.term());
+        if (cmp != 0)
         {
-            return a.docId > b.docId;
+            return cmp < 0;
         }
+        if (x.docId != y.docId)
+        {
+            return x.docId < y.docId;
+        }
+        return a < b;
     }
-};
 
-// GLOBALS
-vector<ifstream> inputFiles;
-vector<char> outputBuf;
-size_t outCurPos = 0;
+    // leaves are nodes k..2k-1 (run = node - k), returns the winner of the subtree
+    int buildLoserTree(int node)
+    {
+        int k = inputFiles.size();
+        if (node >= k)
+        {
+            return node - k;
+        }
+        int left = buildLoserTree(2 * node);
+        int right = buildLoserTree(2 * node + 1);
+        if (beats(left, right))
+        {
+            losers[node] = right;
+            return left;
+        }
+        losers[node] = left;
+        return right;
+    }
+
+    // run has moved to its next posting, replay its matches up to the root
+    void replay(int run)
+    {
+        int winner = run;
+        for (int node = (run + inputFiles.size()) / 2; node >= 1; node /= 2)
+        {
+            if (beats(losers[node], winner))
+            {
+                swap(losers[node], winner);
+            }
+        }
+        losers[0] = winner;
+    }
 
-// for min heap, need a greater than comparator, comparator has to be a type
-priority_queue<PostingEntry, vector<PostingEntry>, ComparePosting> minHeap;
+    void advance(int run)
+    {
+        RunReader &reader = inputFiles[run];
+        live[run] = reader.next() && (endTerm.empty() || reader.term() < endTerm);
+    }
+};
 
-// initially had used custom buffers for ifstreams but too complex and bug-prone since full records might not fit in buffer since each record is different sizes, so just streamed directly
-bool readNextRecord(int fileIndex, PostingEntry &p)
+// runIndexes[i] is the sparse index of filenames[i], empty if it has none (then the run is read from the start)
+// merged postings go to sink.add(term, termLen, docId, freq), then sink.close(), returns the bytes read from the runs
+template <typename Sink>
+uint64_t mergeRangeInto(const vector<string> &filenames, const vector<vector<RunIndexEntry>> &runIndexes,
+                        const string &startTerm, const string &endTerm, Sink &sink)
 {
-    ifstream &ifs = inputFiles[fileIndex];
-    uint32_t termLen;
-    if (!ifs.read(reinterpret_cast<char *>(&termLen), sizeof(termLen)))
+    RangeMerge merge;
+    merge.startTerm = startTerm;
+    merge.endTerm = endTerm;
+
+    merge.inputFiles.resize(filenames.size());
+    merge.live.assign(filenames.size(), 0);
+    for (size_t i = 0; i < filenames.size(); ++i)
     {
-        return false;
+        RunReader &reader = merge.inputFiles[i];
+        if (!reader.open(filenames[i], runBufferSize))
+        {
+            cerr << "Failed to open " << filenames[i] << endl;
+            exit(1);
+        }
+
+        // seek to the last restart point at or before startTerm, then skip the few terms before it
+        if (!startTerm.empty() && !runIndexes[i].empty())
+        {
+            const vector<RunIndexEntry> &index = runIndexes[i];
+            auto it = upper_bound(index.begin(), index.end(), startTerm, [](const string &term, const RunIndexEntry &entry)
+                                  { return term < entry.term; });
+            if (it != index.begin())
+            {
+                reader.seek(prev(it)->offset);
+            }
+        }
+        merge.advance(i);
+        while (merge.live[i] && reader.term() < startTerm)
+        {
+            merge.advance(i);
+        }
     }
-    if (termLen == 0)
+
+    // initialize tree
+    merge.losers.assign(filenames.size(), 0);
+    merge.losers[0] = merge.buildLoserTree(1);
+
+    // merge
+    while (merge.live[merge.losers[0]])
     {
-        return false;
+        int winner = merge.losers[0];
+        RunReader &reader = merge.inputFiles[winner];
+        sink.add(reader.term().data(), reader.term().size(), reader.docId, reader.freq);
+
+        merge.advance(winner);
+        merge.replay(winner);
     }
 
-    string term(termLen, '\0');
-    if (!ifs.read(&term[0], termLen))
+    // flush out buffer to disk if leftover
+    sink.close();
+
+    // close input files
+    uint64_t bytesRead = 0;
+    for (RunReader &reader : merge.inputFiles)
     {
-        return false;
+        bytesRead += reader.bytesRead;
+        reader.close();
     }
+    return bytesRead;
+}
 
-    int docId, freq;
-    if (!ifs.read(reinterpret_cast<char *>(&docId), sizeof(docId)))
+// withIndex writes a sparse index next to the output so it can be range-merged again (intermediate passes)
+MergeStats mergeRange(const vector<string> &filenames, const vector<vector<RunIndexEntry>> &runIndexes,
+                      const string &startTerm, const string &endTerm, const string &outFile, bool withIndex)
+{
+    RunWriter writer;
+    if (!writer.open(outFile, BUF_SIZE, withIndex))
     {
-        return false;
+        cerr << "Failed to open " << outFile << endl;
+        exit(1);
     }
-    if (!ifs.read(reinterpret_cast<char *>(&freq), sizeof(freq)))
+    MergeStats stats;
+    stats.bytesRead = mergeRangeInto(filenames, runIndexes, startTerm, endTerm, writer);
+    stats.bytesWritten = writer.bytesWritten();
+    return stats;
+}
+
+MergeStats mergeBuffers(const vector<string> &filenames, const string &outFile, bool withIndex = false)
+{
+    vector<vector<RunIndexEntry>> noIndexes(filenames.size());
+    return mergeRange(filenames, noIndexes, "", "", outFile, withIndex);
+}
+
+// pick up to rangeCount - 1 splitter terms from the runs' sparse indexes,
+// every index entry stands for about RUN_INDEX_INTERVAL bytes so ranges get similar amounts of postings
+vector<string> chooseSplitters(const vector<vector<RunIndexEntry>> &runIndexes, unsigned rangeCount)
+{
+    vector<string> samples;
+    for (const auto &index : runIndexes)
     {
-        return false;
+        for (const RunIndexEntry &entry : index)
+        {
+            samples.push_back(entry.term);
+        }
     }
+    sort(samples.begin(), samples.end());
 
-    p = PostingEntry{term, docId, freq, fileIndex};
-    return true;
+    vector<string> splitters;
+    for (unsigned i = 1; i < rangeCount && !samples.empty(); ++i)
+    {
+        const string &term = samples[samples.size() * i / rangeCount];
+        if (splitters.empty() || splitters.back() < term)
+        {
+            splitters.push_back(term);
+        }
+    }
+    return splitters;
 }
 
-void writeMergedRecord(ofstream &ofs, const PostingEntry &p)
+// load the runs' sparse indexes and split the term space into up to rangeCount [startTerm, endTerm) ranges
+vector<pair<string, string>> planRanges(const vector<string> &filenames, unsigned rangeCount, vector<vector<RunIndexEntry>> &runIndexes)
 {
-    uint32_t termLen = static_cast<uint32_t>(p.term.size());
-    size_t recordSize = sizeof(termLen) + p.term.size() + 2 * sizeof(int);
+    runIndexes.assign(filenames.size(), {});
+    if (rangeCount > 1)
+    {
+        for (size_t i = 0; i < filenames.size(); ++i)
+        {
+            if (!loadRunIndex(filenames[i], runIndexes[i]))
+            {
+                cerr << "No sparse index for " << filenames[i] << ", it will be scanned from the start by every range" << endl;
+            }
+        }
+    }
 
-    // flush outputBuffer to disk first if too full and can't fit full record
-    if (outCurPos + recordSize > outputBuf.size())
+    vector<string> splitters = chooseSplitters(runIndexes, rangeCount);
+    vector<pair<string, string>> ranges;
+    for (size_t r = 0; r <= splitters.size(); ++r)
     {
-        ofs.write(outputBuf.data(), outCurPos);
-        outCurPos = 0;
+        string startTerm = r == 0 ? "" : splitters[r - 1];
+        string endTerm = r == splitters.size() ? "" : splitters[r];
+        ranges.push_back({startTerm, endTerm});
     }
+    return ranges;
+}
 
-    // copy data into buffer
-    char *ptr = outputBuf.data() + outCurPos;
-    memcpy(ptr, &termLen, sizeof(termLen));
-    ptr += sizeof(termLen);
-    memcpy(ptr, p.term.data(), termLen);
-    ptr += termLen;
-    memcpy(ptr, &p.docId, sizeof(p.docId));
-    ptr += sizeof(p.docId);
-    memcpy(ptr, &p.freq, sizeof(p.freq));
-    ptr += sizeof(p.freq);
+// merge each range on its own thread into its own segment,
+// the segments concatenated in order are the same stream as a single merged file
+vector<string> mergeInParallel(const vector<string> &filenames, unsigned threadCount, MergeStats &total)
+{
+    vector<vector<RunIndexEntry>> runIndexes;
+    vector<pair<string, string>> ranges = planRanges(filenames, threadCount, runIndexes);
 
-    // update next read pos for output buffer
-    outCurPos += recordSize;
+    vector<string> segments;
+    vector<MergeStats> stats(ranges.size());
+    vector<thread> threads;
+    for (size_t r = 0; r < ranges.size(); ++r)
+    {
+        segments.push_back("merged_segment" + to_string(r) + ".bin");
+    }
+    for (size_t r = 0; r < ranges.size(); ++r)
+    {
+        threads.emplace_back([&, r]
+                             { stats[r] = mergeRange(filenames, runIndexes, ranges[r].first, ranges[r].second, segments[r], false); });
+    }
+    for (size_t r = 0; r < ranges.size(); ++r)
+    {
+        threads[r].join();
+        total.bytesRead += stats[r].bytesRead;
+        total.bytesWritten += stats[r].bytesWritten;
+    }
+    return segments;
 }
 
-void mergeBuffers(const vector<string> &filenames, const string &outFile)
+// FUSED MERGE -> INDEX
+// merge threads hand postings to the index writer in batches instead of writing final_merged.bin
+struct PostingBatch
 {
-    inputFiles.clear();
-    for (const string &filename : filenames)
+    vector<char> termBytes;
+    vector<uint32_t> termEnds;     // end of each term in termBytes
+    vector<uint32_t> postingTerms; // term of each posting
+    vector<uint32_t> docIds;
+    vector<uint32_t> freqs;
+};
+
+// bounded so a merge thread can only run BATCH_QUEUE_DEPTH batches ahead of the index writer
+struct BatchQueue
+{
+    mutex m;
+    condition_variable cv;
+    deque<PostingBatch> batches;
+    bool done = false;
+
+    void push(PostingBatch &&batch)
+    {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&]
+                { return batches.size() < BATCH_QUEUE_DEPTH; });
+        batches.push_back(move(batch));
+        cv.notify_all();
+    }
+
+    void finish()
     {
-        ifstream ifs(filename, ios::binary);
-        if (!ifs)
+        lock_guard<mutex> lock(m);
+        done = true;
+        cv.notify_all();
+    }
+
+    // false once the producer is done and everything was taken
+    bool pop(PostingBatch &batch)
+    {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&]
+                { return !batches.empty() || done; });
+        if (batches.empty())
         {
-            cerr << "Failed to open " << filename << endl;
-            exit(1);
+            return false;
         }
-        inputFiles.push_back(std::move(ifs));
+        batch = move(batches.front());
+        batches.pop_front();
+        cv.notify_all();
+        return true;
     }
+};
+
+// merge sink that fills batches and pushes them to a queue
+struct BatchSink
+{
+    BatchQueue &queue;
+    PostingBatch batch;
 
-    ofstream ofs(outFile, ios::binary);
-    outputBuf.resize(BUF_SIZE); // 1MB buffer
-    outCurPos = 0;
+    explicit BatchSink(BatchQueue &queue) : queue(queue) {}
 
-    // initialize heap
-    minHeap = {}; // clear heap
-    for (size_t i = 0; i < inputFiles.size(); ++i)
+    void add(const char *term, size_t termLen, uint32_t docId, uint32_t freq)
     {
-        PostingEntry p;
-        if (readNextRecord(i, p))
+        size_t lastStart = batch.termEnds.size() < 2 ? 0 : batch.termEnds[batch.termEnds.size() - 2];
+        if (batch.termEnds.empty() || batch.termEnds.back() - lastStart != termLen ||
+            memcmp(batch.termBytes.data() + lastStart, term, termLen) != 0)
+        {
+            batch.termBytes.insert(batch.termBytes.end(), term, term + termLen);
+            batch.termEnds.push_back(batch.termBytes.size());
+        }
+        batch.postingTerms.push_back(batch.termEnds.size() - 1);
+        batch.docIds.push_back(docId);
+        batch.freqs.push_back(freq);
+
+        if (batch.docIds.size() == BATCH_POSTINGS)
         {
-            minHeap.push(p);
+            queue.push(move(batch));
+            batch = PostingBatch();
         }
     }
 
-    // merge
-    while (!minHeap.empty())
+    void close()
     {
-        PostingEntry top = minHeap.top();
-        minHeap.pop(); // doesn't return the element, just pops
-        writeMergedRecord(ofs, top);
+        if (!batch.docIds.empty())
+        {
+            queue.push(move(batch));
+        }
+        queue.finish();
+    }
+};
 
-        PostingEntry nextToFill;
-        if (readNextRecord(top.fileIndex, nextToFill))
+// threadCount merge threads produce, this thread compresses blocks and writes lexicon and metadata as postings arrive,
+// ranges are consumed in order so the index files are the same as merging + index with the same codec and layout
+void mergeAndIndex(const vector<string> &filenames, unsigned threadCount, int codec, bool termAligned, MergeStats &total)
+{
+    vector<vector<RunIndexEntry>> runIndexes;
+    vector<pair<string, string>> ranges = planRanges(filenames, threadCount, runIndexes);
+
+    vector<BatchQueue> queues(ranges.size());
+    vector<uint64_t> bytesRead(ranges.size());
+    vector<thread> threads;
+    for (size_t r = 0; r < ranges.size(); ++r)
+    {
+        threads.emplace_back([&, r]
+                             {
+                                 BatchSink sink(queues[r]);
+                                 bytesRead[r] = mergeRangeInto(filenames, runIndexes, ranges[r].first, ranges[r].second, sink); });
+    }
+
+    IndexWriter writer;
+    writer.setCodec(codec);
+    writer.setTermAligned(termAligned);
+    if (!writer.open("compressed_inverted_index.bin", "lexicon.bin", "metadata.bin"))
+    {
+        cerr << "Failed to open index output files" << endl;
+        exit(1);
+    }
+    // per-block and per-term score bounds for block-max query processing
+    if (!writer.setMaxScores("max_scores.bin", "page_table.txt"))
+    {
+        cerr << "No page_table.txt, max_scores.bin not written" << endl;
+    }
+    PostingBatch batch;
+    for (BatchQueue &queue : queues)
+    {
+        while (queue.pop(batch))
         {
-            minHeap.push(nextToFill);
+            for (size_t i = 0; i < batch.docIds.size(); ++i)
+            {
+                uint32_t t = batch.postingTerms[i];
+                uint32_t termStart = t == 0 ? 0 : batch.termEnds[t - 1];
+                writer.add(batch.termBytes.data() + termStart, batch.termEnds[t] - termStart, batch.docIds[i], batch.freqs[i]);
+            }
         }
     }
+    writer.close();
+    total.bytesWritten += writer.bytesWritten();
 
-    // flush out buffer to disk if leftover
-    if (outCurPos > 0)
+    for (size_t r = 0; r < ranges.size(); ++r)
     {
-        ofs.write(outputBuf.data(), outCurPos);
+        threads[r].join();
+        total.bytesRead += bytesRead[r];
     }
+}
 
-    ofs.close();
+// MULTI-PASS MERGE
+// with more runs than can be open at once, earlier passes merge groups of the smallest runs into intermediate runs,
+// as few as it takes for the final merge to have exactly fanIn runs (the optimal merge cascade, like an fanIn-ary Huffman tree)
 
-    // close input files
-    for (ifstream &ifs : inputFiles)
+// runs every merge can have open: the memory budget over the read buffers of threadCount concurrent merges,
+// capped by the open file limit
+size_t chooseFanIn(size_t memoryBudget, unsigned threadCount)
+{
+    size_t fanIn = memoryBudget / (threadCount * runBufferSize);
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    {
+        size_t fileLimit = limit.rlim_cur > 64 ? (limit.rlim_cur - 64) / threadCount : 2;
+        fanIn = min(fanIn, fileLimit);
+    }
+    return max<size_t>(fanIn, 2);
+}
+
+uint64_t runBytes(const string &run)
+{
+    ifstream ifs(run, ios::binary | ios::ate);
+    return ifs ? static_cast<uint64_t>(ifs.tellg()) : 0;
+}
+
+// one intermediate pass: the first group takes (n - 2) mod (fanIn - 1) + 2 of the smallest runs so every later merge
+// can take fanIn runs, then groups of fanIn of the next smallest while at least fanIn runs are left for the final merge,
+// every other run is carried to the next pass unchanged; groups are merged threadCount at a time into passN_runG.bin,
+// with sparse indexes for the next pass, merged gets the runs that went into a group
+vector<string> mergePass(const vector<string> &runs, size_t fanIn, int pass, unsigned threadCount, MergeStats &total, vector<string> &merged)
+{
+    vector<uint64_t> sizes(runs.size());
+    vector<size_t> order(runs.size());
+    for (size_t i = 0; i < runs.size(); ++i)
+    {
+        sizes[i] = runBytes(runs[i]);
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                { return sizes[a] < sizes[b]; });
+
+    size_t first = (runs.size() - 2) % (fanIn - 1) + 2;
+    size_t left = runs.size() - (first - 1); // runs after this pass
+    vector<size_t> groupEnds = {first};
+    while (groupEnds.back() + fanIn <= runs.size() && left - (fanIn - 1) >= fanIn)
+    {
+        groupEnds.push_back(groupEnds.back() + fanIn);
+        left -= fanIn - 1;
+    }
+
+    size_t groupCount = groupEnds.size();
+    vector<string> outputs(groupCount);
+    vector<MergeStats> stats(groupCount);
+    atomic<size_t> nextGroup{0};
+
+    auto worker = [&]
+    {
+        size_t g;
+        while ((g = nextGroup++) < groupCount)
+        {
+            vector<string> group;
+            for (size_t i = g == 0 ? 0 : groupEnds[g - 1]; i < groupEnds[g]; ++i)
+            {
+                group.push_back(runs[order[i]]);
+            }
+            outputs[g] = "pass" + to_string(pass) + "_run" + to_string(g) + ".bin";
+            stats[g] = mergeBuffers(group, outputs[g], true);
+        }
+    };
+    vector<thread> threads;
+    for (unsigned t = 0; t < min<size_t>(threadCount, groupCount); ++t)
+    {
+        threads.emplace_back(worker);
+    }
+    for (thread &t : threads)
+    {
+        t.join();
+    }
+
+    for (const MergeStats &s : stats)
+    {
+        total.bytesRead += s.bytesRead;
+        total.bytesWritten += s.bytesWritten;
+    }
+    merged.clear();
+    for (size_t i = 0; i < groupEnds.back(); ++i)
+    {
+        merged.push_back(runs[order[i]]);
+    }
+    for (size_t i = groupEnds.back(); i < runs.size(); ++i)
+    {
+        outputs.push_back(runs[order[i]]);
+    }
+    return outputs;
+}
+
+// intermediate runs (and their sparse indexes) are removed once they are merged, parsing's temp files are kept
+void deleteRuns(const vector<string> &runs, const vector<string> &tempFiles)
+{
+    for (const string &run : runs)
+    {
+        if (find(tempFiles.begin(), tempFiles.end(), run) != tempFiles.end())
+        {
+            continue;
+        }
+        remove(run.c_str());
+        remove(runIndexFile(run).c_str());
+    }
+}
+
+void reportPass(const string &pass, size_t inputRuns, size_t outputs, const MergeStats &stats, long long ms)
+{
+    std::cout << "Pass " << pass << ": " << inputRuns << " runs -> " << outputs << ", read " << stats.bytesRead
+              << " bytes, wrote " << stats.bytesWritten << " bytes, " << ms << " ms" << std::endl;
+}
+
+vector<string> loadRunManifest(const string &manifestFile)
+{
+    ifstream ifs(manifestFile);
+    if (!ifs)
+    {
+        cerr << "Failed to open " << manifestFile << endl;
+        exit(1);
+    }
+
+    vector<string> filenames;
+    string line;
+    while (getline(ifs, line))
     {
-        ifs.close();
+        if (!line.empty())
+        {
+            filenames.push_back(line);
+        }
     }
+    return filenames;
 }
 
-int main()
+void outputMergedManifest(const vector<string> &mergedFiles)
+{
+    ofstream ofs(MERGED_MANIFEST);
+    for (const string &filename : mergedFiles)
+    {
+        ofs << filename << '\n';
+    }
+    ofs.close();
+}
+
+int main(int argc, char *argv[])
 {
     using namespace std::chrono;
     auto startTime = high_resolution_clock::now(); // record start
 
-    // set up 16 temp files
-    vector<string> temp16Files;
-    for (int i = 0; i < FILE_COUNT; ++i)
+    // --threads P merges P term ranges in parallel into P segments instead of one final_merged.bin
+    // --codec / --spanning-blocks as for index, only used by --fused
+    unsigned threadCount = 1;
+    bool fused = false;
+    int codec = CODEC_AUTO;
+    bool termAligned = true;
+    size_t fanIn = 0; // 0 = pick from the memory budget
+    size_t memoryBudgetMB = DEFAULT_MEMORY_BUDGET_MB;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+        {
+            threadCount = max(1, stoi(argv[++i]));
+        }
+        else if (arg == "--fused")
+        {
+            fused = true; // also build the index here, no final_merged.bin and no index step
+        }
+        else if (arg == "--codec" && i + 1 < argc)
+        {
+            codec = codecFromName(argv[++i]);
+            if (codec == CODEC_COUNT)
+            {
+                cerr << "Unknown codec " << argv[i] << ", use varbyte, bitpack, pfor, streamvbyte or auto" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--spanning-blocks")
+        {
+            termAligned = false;
+        }
+        else if (arg == "--fan-in" && i + 1 < argc)
+        {
+            fanIn = max(2, stoi(argv[++i]));
+        }
+        else if (arg == "--run-buffer-kb" && i + 1 < argc)
+        {
+            runBufferSize = max(16, stoi(argv[++i])) * 1024;
+        }
+        else if (arg == "--mem-mb" && i + 1 < argc)
+        {
+            memoryBudgetMB = max(1, stoi(argv[++i]));
+        }
+    }
+
+    // parsing lists every run it flushed in the run manifest, the count depends on its memory budget
+    vector<string> tempFiles = loadRunManifest(RUN_MANIFEST);
+    if (tempFiles.empty())
+    {
+        cerr << "No temp files listed in " << RUN_MANIFEST << endl;
+        return 1;
+    }
+
+    if (fanIn == 0)
     {
-        temp16Files.push_back("temp" + to_string(i) + ".bin");
+        fanIn = chooseFanIn(memoryBudgetMB * 1024 * 1024, threadCount);
     }
 
-    // merge 16 -> 1
-    string finalIndex = "final_merged.bin";
-    mergeBuffers(temp16Files, finalIndex);
+    // cascade until every run fits in one final merge
+    vector<string> runs = tempFiles;
+    int pass = 1;
+    while (runs.size() > fanIn)
+    {
+        auto passStart = high_resolution_clock::now();
+        MergeStats stats;
+        vector<string> merged;
+        vector<string> nextRuns = mergePass(runs, fanIn, pass, threadCount, stats, merged);
+        deleteRuns(merged, tempFiles);
+        reportPass(to_string(pass), runs.size(), nextRuns.size(), stats, duration_cast<milliseconds>(high_resolution_clock::now() - passStart).count());
+        runs = nextRuns;
+        ++pass;
+    }
+
+    auto passStart = high_resolution_clock::now();
+    MergeStats stats;
+    vector<string> mergedFiles;
+    if (fused)
+    {
+        mergeAndIndex(runs, threadCount, codec, termAligned, stats);
+    }
+    else if (threadCount == 1)
+    {
+        // merge n -> 1
+        string finalIndex = "final_merged.bin";
+        stats = mergeBuffers(runs, finalIndex);
+        mergedFiles.push_back(finalIndex);
+    }
+    else
+    {
+        mergedFiles = mergeInParallel(runs, threadCount, stats);
+    }
+    deleteRuns(runs, tempFiles);
+    reportPass(to_string(pass) + " (final)", runs.size(), fused ? 1 : mergedFiles.size(), stats, duration_cast<milliseconds>(high_resolution_clock::now() - passStart).count());
+
+    if (fused)
+    {
+        auto endTime = high_resolution_clock::now();
+        auto duration = duration_cast<milliseconds>(endTime - startTime).count();
+        std::cout << "Elapsed time: " << duration << " ms" << std::endl;
+        std::cout << "Built index from " << tempFiles.size() << " temp files using " << threadCount << " merge threads" << std::endl;
+        return 0;
+    }
+    outputMergedManifest(mergedFiles);
 
     auto endTime = high_resolution_clock::now();
     auto duration = duration_cast<milliseconds>(endTime - startTime).count();
     std::cout << "Elapsed time: " << duration << " ms" << std::endl;
+    std::cout << "Wrote " << mergedFiles.size() << " merged files using " << threadCount << " threads" << std::endl;
 
     return 0;
 }
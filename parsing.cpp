@@ -4,133 +4,438 @@
 #include <string>
 #include <sstream>
 #include <cctype>
+#include <cstring>
+#include <algorithm>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include "tokenizer.h"
+#include "run_format.h"
+#include "index_writer.h"
 using namespace std;
 
-// intermediate posting
-struct Posting
+// intermediate posting is a packed 64-bit key: term id in the high 32 bits, passage index within the run in the low 32 bits,
+// its freq waits in the matching slot of the sort scratch until the run is flushed
+// at flush time the term id is replaced by its sorted rank and the freq is packed into the low bits,
+// so sorting the keys as integers sorts by term then docId
+
+// docIds in the index are internal: passages are numbered 0..N-1 in input order, whatever their passage ids
+// page_table.txt maps docId -> length, doc_ids.bin holds the passage id of every docId (uint32 each) for the TREC output
+
+// runs are flushed whenever a worker's buffers are about to fill, so the number of runs follows the memory budget
+// (--mem-mb, split evenly across workers) instead of the corpus size
+const size_t DEFAULT_MEMORY_BUDGET_MB = 1024;
+const double POSTING_BUDGET_SHARE = 0.6;    // keys + radix sort scratch, 16 bytes per posting
+const double TERM_BUDGET_SHARE = 0.2;       // distinct term bytes
+const double DICTIONARY_BUDGET_SHARE = 0.2; // term offsets + hash slots
+const size_t DICTIONARY_BYTES_PER_TERM = 20; // 4 byte offset + up to 4 slots of 4 bytes (next power of two above 2x terms)
+
+const string RUN_MANIFEST = "runs.manifest"; // one run filename per line, read by merging
+
+atomic<unsigned> tempFileCount{0}; // shared so run names stay unique across workers
+
+// assigns every distinct term of the current run a dense id, each term string is stored once
+struct TermDictionary
 {
-    const char *termPtr; // ptr to term in shared term buffer, to ensure same size across all postings
-    int docId;
-};
+    vector<char> termBuffer;      // e.g. [dog\0cat\0apple\0]
+    size_t termBufferOffset = 0;  // current write offset
+    vector<uint32_t> termOffsets; // term id -> offset of term in termBuffer
+    vector<uint32_t> slots;       // open addressing table, holds term id + 1 (0 = empty)
+    size_t maxTerms = 0;          // caller flushes before more distinct terms than this are added
 
-const int DATASET_SIZE = 1000000;
-const int TEMP_FILES_NUM = 16; // +1 for leftover buffer at the end
-const int DOCS_PER_FILE = DATASET_SIZE / TEMP_FILES_NUM;
+    static uint32_t hash(const char *term, size_t len)
+    {
+        // FNV-1a
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; ++i)
+        {
+            h = (h ^ static_cast<unsigned char>(term[i])) * 16777619u;
+        }
+        return h;
+    }
 
-// for posting buffer
-const int POSTING_BUFFER_SIZE = (100 * 1024 * 1024) / sizeof(Posting);
-Posting postingBuffer[POSTING_BUFFER_SIZE];
-unsigned postingBufferIndex = 0;
+    const char *termAt(uint32_t termId) const
+    {
+        return termBuffer.data() + termOffsets[termId];
+    }
 
-// for term buffer
-const int TERM_BUFFER_SIZE = 150 * 1024 * 1024; // 150 MB
-char termBuffer[TERM_BUFFER_SIZE];              // e.g. [dog\0cat\0apple\0]
-unsigned termBufferOffset = 0;                  // current write offset
+    size_t termLength(uint32_t termId) const
+    {
+        size_t end = termId + 1 < termOffsets.size() ? termOffsets[termId + 1] : termBufferOffset;
+        return end - termOffsets[termId] - 1; // minus null terminator
+    }
 
-// for page table
-unordered_map<int, int> pageTable;
+    // size the buffers once for the worker's share of the memory budget
+    void allocate(size_t termBytes, size_t termCapacity)
+    {
+        termBuffer.resize(termBytes);
+        maxTerms = termCapacity;
+        termOffsets.reserve(maxTerms);
 
-unsigned tempFileCount = 0;
-int docCount = 0;
+        // power of two with load factor at most 0.5 when full
+        size_t slotCount = 1;
+        while (slotCount < 2 * maxTerms)
+        {
+            slotCount <<= 1;
+        }
+        slots.assign(slotCount, 0);
+    }
 
-void openFile(ifstream &ifs, const string &inputFile)
-{
-    ifs.open(inputFile);
+    // room for `terms` more distinct terms taking at most `bytes` bytes (null terminators included)
+    bool hasRoom(size_t terms, size_t bytes) const
+    {
+        return termOffsets.size() + terms <= maxTerms && termBufferOffset + bytes <= termBuffer.size();
+    }
 
-    if (!ifs)
+    uint32_t intern(const char *term, size_t len)
     {
-        cerr << "Failed to open file: " << inputFile;
-        exit(1);
+        size_t mask = slots.size() - 1;
+        size_t slot = hash(term, len) & mask;
+        while (slots[slot] != 0)
+        {
+            const char *existing = termAt(slots[slot] - 1);
+            if (memcmp(existing, term, len) == 0 && existing[len] == '\0')
+            {
+                return slots[slot] - 1;
+            }
+            slot = (slot + 1) & mask; // linear probing
+        }
+
+        // new term -> copy once into term buffer, include null terminator
+        uint32_t termId = termOffsets.size();
+        char *ptr = termBuffer.data() + termBufferOffset;
+        memcpy(ptr, term, len);
+        ptr[len] = '\0';
+        termOffsets.push_back(termBufferOffset);
+        termBufferOffset += len + 1;
+        slots[slot] = termId + 1;
+        return termId;
     }
-}
 
-bool compareCstring(const Posting &a, const Posting &b)
+    // double whatever is short so hasRoom(terms, bytes) holds, used by the in-memory build which never flushes
+    void grow(size_t terms, size_t bytes)
+    {
+        while (termBufferOffset + bytes > termBuffer.size())
+        {
+            termBuffer.resize(max<size_t>(2 * termBuffer.size(), 1 << 16));
+        }
+        if (termOffsets.size() + terms <= maxTerms)
+        {
+            return;
+        }
+        while (termOffsets.size() + terms > maxTerms)
+        {
+            maxTerms = max<size_t>(2 * maxTerms, 1 << 12);
+        }
+
+        // rehash every term into the bigger table
+        size_t slotCount = slots.size();
+        while (slotCount < 2 * maxTerms)
+        {
+            slotCount <<= 1;
+        }
+        slots.assign(slotCount, 0);
+        size_t mask = slotCount - 1;
+        for (uint32_t termId = 0; termId < termOffsets.size(); ++termId)
+        {
+            size_t slot = hash(termAt(termId), termLength(termId)) & mask;
+            while (slots[slot] != 0)
+            {
+                slot = (slot + 1) & mask;
+            }
+            slots[slot] = termId + 1;
+        }
+    }
+
+    void clear()
+    {
+        termBufferOffset = 0;
+        termOffsets.clear();
+        fill(slots.begin(), slots.end(), 0);
+    }
+};
+
+// counts the terms of one passage so each (term, doc) pair is emitted once with its freq
+// open addressing keyed by term id, only the slots used by the passage are reset afterwards
+struct DocTermCounts
 {
-    // <0 if s1 comes before s2
-    // =0 if s1 == s2
-    // >0 if s1 comes after s2
-    int result = strcmp(a.termPtr, b.termPtr);
-    if (result == 0)
+    vector<uint32_t> slotTerm; // term id + 1 (0 = empty)
+    vector<uint32_t> slotFreq;
+    vector<uint32_t> usedSlots; // in first-seen order
+
+    // make sure a passage with up to maxTerms distinct terms keeps load factor under 0.5
+    void reserve(size_t maxTerms)
     {
-        return a.docId < b.docId;
+        if (2 * maxTerms <= slotTerm.size())
+        {
+            return;
+        }
+        size_t slotCount = 64;
+        while (slotCount < 2 * maxTerms)
+        {
+            slotCount <<= 1;
+        }
+        slotTerm.assign(slotCount, 0);
+        slotFreq.assign(slotCount, 0);
     }
-    else
+
+    void add(uint32_t termId)
     {
-        return result < 0;
+        size_t mask = slotTerm.size() - 1;
+        size_t slot = (termId * 2654435761u) & mask; // multiplicative hash, term ids are dense
+        while (slotTerm[slot] != 0 && slotTerm[slot] != termId + 1)
+        {
+            slot = (slot + 1) & mask;
+        }
+        if (slotTerm[slot] == 0)
+        {
+            slotTerm[slot] = termId + 1;
+            usedSlots.push_back(slot);
+        }
+        ++slotFreq[slot];
     }
-}
 
-int partition(int low, int high)
+    void clear()
+    {
+        for (uint32_t slot : usedSlots)
+        {
+            slotTerm[slot] = 0;
+            slotFreq[slot] = 0;
+        }
+        usedSlots.clear();
+    }
+};
+
+// in-memory build: every term of the worker's range keeps a growable compressed posting list,
+// docs are the worker's passage ordinals (pageTable index), so gaps are always positive even if passage ids are not sorted
+struct MemoryIndex
 {
-    Posting pivot = postingBuffer[high];
-    int i = low - 1;
-    for (int j = low; j <= high - 1; j++)
+    struct TermPostings
+    {
+        vector<unsigned char> bytes; // (varbyte ordinal gap, varbyte freq) pairs
+        uint32_t lastOrdinal = 0;
+    };
+
+    TermDictionary dictionary;
+    vector<TermPostings> postings; // indexed by term id
+
+    void add(uint32_t termId, uint32_t ordinal, uint32_t freq)
     {
-        if (compareCstring(postingBuffer[j], pivot))
+        if (termId >= postings.size())
         {
-            i++;
-            swap(postingBuffer[i], postingBuffer[j]);
+            postings.resize(termId + 1);
         }
+        TermPostings &list = postings[termId];
+        varbyteEncode(list.bytes, ordinal - list.lastOrdinal);
+        varbyteEncode(list.bytes, freq);
+        list.lastOrdinal = ordinal;
     }
+};
+
+// everything one run needs until it is on disk, so a full run can be sorted and written while the next one fills
+struct RunBuffer
+{
+    // for posting buffer
+    vector<uint64_t> postingBuffer;
+    vector<uint64_t> sortBuffer; // radix sort scratch, same size as postingBuffer
+    size_t postingBufferIndex = 0;
+
+    // for term buffer
+    TermDictionary dictionary;
+
+    vector<uint32_t> docIds; // internal docIds of this run, indexed by the run doc stored in the keys
+};
+
+// each worker parses its own byte range of the input with its own buffers and flushes its own runs
+struct ParseWorker
+{
+    uint64_t startOffset; // first byte of range, moved forward to the next line start
+    uint64_t endOffset;   // lines starting at or after this belong to the next worker
+
+    // with --pipelined the reader fills one buffer while flushThread sorts and writes the other
+    RunBuffer runBuffers[2];
+    int activeBuffer = 0;
+    bool pipelined = false;
+    thread flushThread;
+
+    // with --in-memory postings go here instead of into runs
+    bool inMemory = false;
+    MemoryIndex memoryIndex;
+
+    vector<char> scratch; // lowercased copy of the current passage, terms are sliced out of it
+    DocTermCounts docTermCounts;
+
+    // for page table, (passage id, length) in input order so workers can be concatenated
+    vector<pair<int, int>> pageTable;
+    uint32_t firstDoc = 0;     // internal docId of the worker's first passage, from the counting pass
+    uint32_t passageCount = 0; // passages whose line starts in the range
 
-    swap(postingBuffer[i + 1], postingBuffer[high]);
-    return i + 1;
+    vector<string> runFiles; // temp files this worker wrote, in order, only touched by the thread flushing
+};
+
+// number of bits needed to store values 0..maxValue
+int bitWidth(uint64_t maxValue)
+{
+    int bits = 0;
+    while (bits < 64 && (maxValue >> bits) != 0)
+    {
+        ++bits;
+    }
+    return bits;
 }
 
-// term then docid then freq - will bring down complexity by several orders
-// few hundred to few thousands
-// each nlogn
-// thousands to hundreds
-// can optimize code in memory mgmt
-void quickSortBuffer(int low, int high)
+// LSD radix sort on 8-bit digits, result ends up back in keys
+// digits that are the same for every key (e.g. high bytes of small ids) are skipped
+void radixSort(uint64_t *keys, uint64_t *scratch, size_t n)
 {
-    if (low < high)
+    // one pass to build the histograms of all 8 digits
+    static thread_local size_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint64_t key = keys[i];
+        for (int d = 0; d < 8; ++d)
+        {
+            ++counts[d][(key >> (8 * d)) & 255];
+        }
+    }
+
+    uint64_t *src = keys;
+    uint64_t *dst = scratch;
+    for (int d = 0; d < 8; ++d)
     {
-        int partitionIndex = partition(low, high);
+        size_t *count = counts[d];
+        if (count[(src[0] >> (8 * d)) & 255] == n)
+        {
+            continue; // every key has the same digit, pass would be a no-op
+        }
 
-        quickSortBuffer(low, partitionIndex - 1);
-        quickSortBuffer(partitionIndex + 1, high);
+        // prefix sums -> bucket start positions
+        size_t offset = 0;
+        for (int bucket = 0; bucket < 256; ++bucket)
+        {
+            size_t c = count[bucket];
+            count[bucket] = offset;
+            offset += c;
+        }
+
+        // stable scatter
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint64_t key = src[i];
+            dst[count[(key >> (8 * d)) & 255]++] = key;
+        }
+        swap(src, dst);
+    }
+
+    if (src != keys)
+    {
+        memcpy(keys, src, n * sizeof(uint64_t));
     }
 }
 
-int tokenizeSentence(int docId, const string &sentence)
+// count the terms of one passage into worker.docTermCounts, returns the passage length in terms
+int countTerms(ParseWorker &worker, TermDictionary &dictionary, const char *sentence, size_t len)
 {
     int termCount = 0;
-    string term;
-    stringstream ss(sentence);
-    while (ss >> term)
-    {
-        if (term.empty())
-            continue;
+    DocTermCounts &counts = worker.docTermCounts;
+    counts.reserve(len / 2 + 1);
+    tokenize(sentence, len, worker.scratch, [&](const char *term, size_t termLen)
+             {
+                 // add to term dictionary, only new terms take up term buffer space
+                 counts.add(dictionary.intern(term, termLen));
+                 ++termCount; });
+    return termCount;
+}
 
-        size_t termLen = term.size() + 1; // include null terminator
+int tokenizeSentence(ParseWorker &worker, RunBuffer &run, uint32_t runDoc, const char *sentence, size_t len)
+{
+    int termCount = countTerms(worker, run.dictionary, sentence, len);
+    DocTermCounts &counts = worker.docTermCounts;
+
+    // one posting per distinct term of the passage, freq parked in the sort scratch until flush
+    for (uint32_t slot : counts.usedSlots)
+    {
+        uint64_t termId = counts.slotTerm[slot] - 1;
+        run.postingBuffer[run.postingBufferIndex] = (termId << 32) | runDoc;
+        run.sortBuffer[run.postingBufferIndex] = counts.slotFreq[slot];
+        ++run.postingBufferIndex;
+    }
+    counts.clear();
+    return termCount;
+}
 
-        // add to term buffer, increment termBufferOffset by termLen
-        char *ptr = termBuffer + termBufferOffset;
-        // memcpy(dest, src, n) - copies n bytes from src to dst
-        memcpy(ptr, term.c_str(), termLen);
-        termBufferOffset += termLen;
+int indexSentence(ParseWorker &worker, uint32_t ordinal, const char *sentence, size_t len)
+{
+    MemoryIndex &index = worker.memoryIndex;
+    index.dictionary.grow(len / 2 + 1, len + 1); // same worst case as the flush check in parsePassage
+    int termCount = countTerms(worker, index.dictionary, sentence, len);
+    DocTermCounts &counts = worker.docTermCounts;
 
-        // add to postingBuffer, increment postingBufferIndex
-        postingBuffer[postingBufferIndex++] = Posting{ptr, docId};
-        ++termCount;
+    for (uint32_t slot : counts.usedSlots)
+    {
+        index.add(counts.slotTerm[slot] - 1, ordinal, counts.slotFreq[slot]);
     }
+    counts.clear();
     return termCount;
 }
 
-void outputFile()
+void outputFile(ParseWorker &worker, RunBuffer &run)
 {
-    if (postingBufferIndex == 0)
+    if (run.postingBufferIndex == 0)
     {
+        run.docIds.clear();
         return; // nothing to flush
     }
 
-    quickSortBuffer(0, postingBufferIndex - 1);
+    // sort the distinct terms once, then replace each term id by its lexicographic rank
+    // so the integer sort of the keys gives term order without comparing strings per posting
+    TermDictionary &dictionary = run.dictionary;
+    uint32_t termCount = dictionary.termOffsets.size();
+    vector<uint32_t> sortedTermIds(termCount);
+    for (uint32_t termId = 0; termId < termCount; ++termId)
+    {
+        sortedTermIds[termId] = termId;
+    }
+    sort(sortedTermIds.begin(), sortedTermIds.end(), [&](uint32_t a, uint32_t b)
+         { return strcmp(dictionary.termAt(a), dictionary.termAt(b)) < 0; });
+
+    vector<uint32_t> termRank(termCount);
+    for (uint32_t rank = 0; rank < termCount; ++rank)
+    {
+        termRank[sortedTermIds[rank]] = rank;
+    }
 
-    const char *lastTermPtr = postingBuffer[0].termPtr;
-    int lastDoc = postingBuffer[0].docId;
-    int freq = 1;
+    // run docs are in input order, so they are already in docId order
+    const uint32_t *runDocs = run.docIds.data();
+    uint32_t runDocCount = run.docIds.size();
+
+    // pack (term rank, run doc, freq) into one key using only as many bits as this run needs
+    uint64_t *postingBuffer = run.postingBuffer.data();
+    uint64_t *sortBuffer = run.sortBuffer.data();
+    size_t postingCount = run.postingBufferIndex;
+    uint64_t maxFreq = 0;
+    for (size_t i = 0; i < postingCount; ++i)
+    {
+        maxFreq = max(maxFreq, sortBuffer[i]);
+    }
+    int freqBits = bitWidth(maxFreq);
+    int docBits = bitWidth(runDocCount - 1);
+    if (bitWidth(termCount - 1) + docBits + freqBits > 64)
+    {
+        cerr << "Run too large to pack into 64-bit sort keys, lower --mem-mb" << endl;
+        exit(1);
+    }
+    uint64_t freqMask = (uint64_t(1) << freqBits) - 1;
+    uint64_t docMask = (uint64_t(1) << docBits) - 1;
+
+    for (size_t i = 0; i < postingCount; ++i)
+    {
+        uint64_t rank = termRank[postingBuffer[i] >> 32];
+        uint64_t doc = postingBuffer[i] & 0xFFFFFFFFu;
+        postingBuffer[i] = (((rank << docBits) | doc) << freqBits) | sortBuffer[i];
+    }
+    radixSort(postingBuffer, sortBuffer, postingCount);
 
     // set up file for flush to disk
     string filename = "temp";
@@ -138,116 +443,425 @@ void outputFile()
     stringstream ss;
     ss << filename << tempFileCount++ << "." << extension;
     filename = ss.str();
-    ofstream ofs(filename, ios::binary);
+    RunWriter writer;
+    if (!writer.open(filename, 1 << 20, true)) // with a sparse index so merging can split the runs by term range
+    {
+        cerr << "Failed to open " << filename << endl;
+        exit(1);
+    }
+    worker.runFiles.push_back(filename);
+
+    // keys are unique, repeats within a passage were already folded into freq
+    for (size_t i = 0; i < postingCount; ++i)
+    {
+        uint64_t key = postingBuffer[i];
+        uint32_t freq = static_cast<uint32_t>(key & freqMask);
+        uint32_t docId = runDocs[(key >> freqBits) & docMask];
+        uint32_t termId = sortedTermIds[key >> (freqBits + docBits)];
+        writer.add(dictionary.termAt(termId), dictionary.termLength(termId), docId, freq);
+    }
+    writer.close();
+
+    // reset for next temp file
+    run.postingBufferIndex = 0;
+    run.docIds.clear();
+    dictionary.clear();
+}
+
+// hand the active buffer to a background flush and switch to the other one,
+// or flush in place when not pipelined
+void flushRun(ParseWorker &worker)
+{
+    RunBuffer &run = worker.runBuffers[worker.activeBuffer];
+    if (!worker.pipelined)
+    {
+        outputFile(worker, run);
+        return;
+    }
+
+    // the other buffer is reused next, so its flush has to be done first
+    if (worker.flushThread.joinable())
+    {
+        worker.flushThread.join();
+    }
+    worker.flushThread = thread(outputFile, ref(worker), ref(run));
+    worker.activeBuffer ^= 1;
+}
 
-    // postingBufferIndex is where we last ended
-    for (int i = 0; i < postingBufferIndex; ++i)
+// parse the leading passage id like `ss >> docId` did, leaves ptr just past the digits
+bool parseDocId(const char *&ptr, const char *end, int &docId)
+{
+    while (ptr < end && isspace((unsigned char)*ptr))
+    {
+        ++ptr;
+    }
+    bool negative = ptr < end && *ptr == '-';
+    if (ptr < end && (*ptr == '-' || *ptr == '+'))
+    {
+        ++ptr;
+    }
+
+    const char *digitsStart = ptr;
+    long long value = 0;
+    while (ptr < end && *ptr >= '0' && *ptr <= '9')
+    {
+        value = value * 10 + (*ptr - '0');
+        ++ptr;
+    }
+    docId = static_cast<int>(negative ? -value : value);
+    return ptr != digitsStart;
+}
+
+// calls f(passageId, text, textLen) for every well-formed line that starts in the worker's byte range
+template <typename F>
+void forEachPassage(const ParseWorker &worker, const MappedFile &input, F &&f)
+{
+    const char *data = input.data;
+    uint64_t size = input.size;
+
+    // a line belongs to the worker whose range contains its first byte,
+    // so skip the partial line we landed in unless the previous byte ends a line
+    uint64_t pos = worker.startOffset;
+    if (pos > 0 && data[pos - 1] != '\n')
+    {
+        const char *newline = static_cast<const char *>(memchr(data + pos, '\n', size - pos));
+        pos = newline ? (newline - data) + 1 : size;
+    }
+
+    int docId;
+    while (pos < worker.endOffset)
     {
-        const char *termPtr = postingBuffer[i].termPtr;
-        int docId = postingBuffer[i].docId;
+        const char *line = data + pos;
+        const char *newline = static_cast<const char *>(memchr(line, '\n', size - pos));
+        const char *lineEnd = newline ? newline : data + size;
+        pos = (lineEnd - data) + 1; // next line starts after the newline
 
-        if ((strcmp(termPtr, lastTermPtr) == 0) && (docId == lastDoc))
+        const char *sentence = line;
+        if (!parseDocId(sentence, lineEnd, docId))
         {
-            ++freq;
+            continue; // blank or malformed line
         }
-        else
-        {
-            // binary
-            uint32_t termLen = strlen(lastTermPtr);
-            ofs.write(reinterpret_cast<char *>(&termLen), sizeof(termLen));
-            ofs.write(lastTermPtr, termLen);
-            ofs.write(reinterpret_cast<char *>(&lastDoc), sizeof(int));
-            ofs.write(reinterpret_cast<char *>(&freq), sizeof(int));
+        f(docId, sentence, static_cast<size_t>(lineEnd - sentence));
+    }
+}
+
+// first pass: only counts, so every worker knows the internal docId its range starts at before parsing
+void countPassages(ParseWorker &worker, const MappedFile &input)
+{
+    worker.passageCount = 0;
+    forEachPassage(worker, input, [&](int, const char *, size_t)
+                   { ++worker.passageCount; });
+}
+
+// one passage into the active run (or the in-memory lists), it gets the next internal docId of the worker
+void parsePassage(ParseWorker &worker, int passageId, const char *sentence, size_t sentenceLen)
+{
+    uint32_t docId = worker.firstDoc + worker.pageTable.size();
+    if (worker.inMemory)
+    {
+        int docLength = indexSentence(worker, worker.pageTable.size(), sentence, sentenceLen);
+        worker.pageTable.push_back({passageId, docLength});
+        return;
+    }
 
-            lastTermPtr = termPtr;
-            lastDoc = docId;
-            freq = 1;
+    // worst case every other byte starts a new term: at most len / 2 + 1 postings and distinct terms,
+    // and at most len + 1 term bytes including null terminators
+    size_t maxTerms = sentenceLen / 2 + 1;
+    size_t maxTermBytes = sentenceLen + 1;
+    RunBuffer *run = &worker.runBuffers[worker.activeBuffer];
+    if (run->postingBufferIndex + maxTerms > run->postingBuffer.size() || !run->dictionary.hasRoom(maxTerms, maxTermBytes))
+    {
+        flushRun(worker); // flush before the buffers can overflow
+        run = &worker.runBuffers[worker.activeBuffer];
+        if (maxTerms > run->postingBuffer.size() || !run->dictionary.hasRoom(maxTerms, maxTermBytes))
+        {
+            cerr << "Memory budget too small for passage " << passageId << ", increase --mem-mb" << endl;
+            exit(1);
         }
     }
 
-    // final term
-    uint32_t termLen = strlen(lastTermPtr);
-    ofs.write(reinterpret_cast<char *>(&termLen), sizeof(termLen));
-    ofs.write(lastTermPtr, termLen);
-    ofs.write(reinterpret_cast<char *>(&lastDoc), sizeof(int));
-    ofs.write(reinterpret_cast<char *>(&freq), sizeof(int));
-    ofs.close();
+    uint32_t runDoc = run->docIds.size();
+    run->docIds.push_back(docId);
+    int docLength = tokenizeSentence(worker, *run, runDoc, sentence, sentenceLen);
+    worker.pageTable.push_back({passageId, docLength});
+}
 
-    // reset for next temp file
-    postingBufferIndex = 0;
-    termBufferOffset = 0;
+void readFile(ParseWorker &worker, const MappedFile &input)
+{
+    forEachPassage(worker, input, [&](int passageId, const char *sentence, size_t sentenceLen)
+                   { parsePassage(worker, passageId, sentence, sentenceLen); });
+
+    if (worker.inMemory)
+    {
+        return;
+    }
+
+    // leftover buffer at the end, after the background flush so runFiles stays in order
+    if (worker.flushThread.joinable())
+    {
+        worker.flushThread.join();
+    }
+    outputFile(worker, worker.runBuffers[worker.activeBuffer]);
 }
 
-void cleanSentence(string &sentence)
+void outputPageTable(const vector<ParseWorker> &workers)
 {
-    string cleaned;
-    for (char c : sentence)
+    ofstream ofs("page_table.txt");
+    ofstream docIdsOfs("doc_ids.bin", ios::binary);
+
+    // workers cover consecutive byte ranges, so this keeps input order, i.e. docId order
+    uint32_t docId = 0;
+    for (const ParseWorker &worker : workers)
     {
-        unsigned char uc = tolower((unsigned char)c);
-        if (uc <= 127 && !ispunct(uc))
+        for (const auto &entry : worker.pageTable)
         {
-            cleaned += uc; // valid non-punctuation ascii
+            ofs << docId++ << '\t' << entry.second << '\n';
+            uint32_t passageId = entry.first;
+            docIdsOfs.write(reinterpret_cast<const char *>(&passageId), sizeof(passageId));
         }
-        else
+    }
+    ofs.close();
+    docIdsOfs.close();
+}
+
+void outputRunManifest(const vector<ParseWorker> &workers)
+{
+    ofstream ofs(RUN_MANIFEST);
+    for (const ParseWorker &worker : workers)
+    {
+        for (const string &filename : worker.runFiles)
         {
-            cleaned += ' '; // replace separating characters with a space to split terms
+            ofs << filename << '\n';
         }
     }
-    sentence = cleaned;
+    ofs.close();
 }
 
-void readFile(ifstream &ifs)
+// in-memory build: write the index straight from the workers' posting lists, same files as merging + index with the same flags
+void outputMemoryIndex(const vector<ParseWorker> &workers, int codec, bool termAligned)
 {
-    int docId;
-    string line;
-    string sentence;
-    while (getline(ifs, line))
+    // all (worker, term id) pairs in term order, equal terms in worker order
+    vector<pair<uint32_t, uint32_t>> terms;
+    for (uint32_t w = 0; w < workers.size(); ++w)
+    {
+        for (uint32_t termId = 0; termId < workers[w].memoryIndex.dictionary.termOffsets.size(); ++termId)
+        {
+            terms.push_back({w, termId});
+        }
+    }
+    sort(terms.begin(), terms.end(), [&](const pair<uint32_t, uint32_t> &a, const pair<uint32_t, uint32_t> &b)
+         {
+             int cmp = strcmp(workers[a.first].memoryIndex.dictionary.termAt(a.second), workers[b.first].memoryIndex.dictionary.termAt(b.second));
+             return cmp != 0 ? cmp < 0 : a.first < b.first; });
+
+    IndexWriter writer;
+    writer.setCodec(codec);
+    writer.setTermAligned(termAligned);
+    if (!writer.open("compressed_inverted_index.bin", "lexicon.bin", "metadata.bin"))
+    {
+        cerr << "Failed to open index output files" << endl;
+        exit(1);
+    }
+    // per-block and per-term score bounds for block-max query processing
+    if (!writer.setMaxScores("max_scores.bin", "page_table.txt"))
     {
-        stringstream ss(line);
-        ss >> docId;
-        getline(ss, sentence);
-        cleanSentence(sentence); // clean utf-8 misencodings
-        int docLength = tokenizeSentence(docId, sentence);
-        pageTable[docId] = docLength;
+        cerr << "No page_table.txt, max_scores.bin not written" << endl;
+    }
+
+    vector<pair<uint32_t, uint32_t>> postings; // (docId, freq) of the current term
+    size_t i = 0;
+    while (i < terms.size())
+    {
+        const TermDictionary &firstDictionary = workers[terms[i].first].memoryIndex.dictionary;
+        const char *term = firstDictionary.termAt(terms[i].second);
+        size_t termLen = firstDictionary.termLength(terms[i].second);
+
+        // gather the term's list from every worker that saw it
+        postings.clear();
+        for (; i < terms.size(); ++i)
+        {
+            const MemoryIndex &index = workers[terms[i].first].memoryIndex;
+            if (strcmp(index.dictionary.termAt(terms[i].second), term) != 0)
+            {
+                break;
+            }
+
+            const vector<unsigned char> &bytes = index.postings[terms[i].second].bytes;
+            size_t pos = 0;
+            uint32_t ordinal = 0;
+            while (pos < bytes.size())
+            {
+                uint32_t values[2]; // gap, freq
+                for (uint32_t &value : values)
+                {
+                    value = 0;
+                    int shift = 0;
+                    while (bytes[pos] >= 128)
+                    {
+                        value |= static_cast<uint32_t>(bytes[pos++] & 127) << shift;
+                        shift += 7;
+                    }
+                    value |= static_cast<uint32_t>(bytes[pos++]) << shift;
+                }
+                ordinal += values[0];
+                // a worker's ordinals follow its firstDoc, and workers are in docId order, so the list stays sorted
+                postings.push_back({workers[terms[i].first].firstDoc + ordinal, values[1]});
+            }
+        }
 
-        ++docCount;
-        if (docCount > 0 && (docCount % DOCS_PER_FILE == 0))
+        for (const auto &posting : postings)
         {
-            outputFile(); // flush every 62.5K docs
+            writer.add(term, termLen, posting.first, posting.second);
         }
     }
+    writer.close();
 }
 
-void outputPageTable()
+// split the input into threadCount byte ranges and parse them in parallel
+// each worker gets memoryBudget / threadCount bytes for its buffers, split in two when pipelined
+void parseInParallel(const string &inputFile, unsigned threadCount, size_t memoryBudget, bool pipelined, bool inMemory, vector<ParseWorker> &workers)
 {
-    ofstream ofs("page_table.txt");
+    // every worker scans its range straight out of one shared read-only mapping
+    MappedFile input;
+    if (!input.open(inputFile))
+    {
+        cerr << "Failed to open file: " << inputFile;
+        exit(1);
+    }
+    uint64_t fileSize = input.size;
+
+    int bufferCount = pipelined ? 2 : 1;
+    size_t workerBudget = memoryBudget / threadCount / bufferCount;
+    size_t postingCapacity = workerBudget * POSTING_BUDGET_SHARE / (2 * sizeof(uint64_t));
+    size_t termBytes = workerBudget * TERM_BUDGET_SHARE;
+    size_t termCapacity = workerBudget * DICTIONARY_BUDGET_SHARE / DICTIONARY_BYTES_PER_TERM;
+
+    workers.resize(threadCount);
+    for (unsigned i = 0; i < threadCount; ++i)
+    {
+        ParseWorker &worker = workers[i];
+        worker.startOffset = fileSize * i / threadCount;
+        worker.endOffset = fileSize * (i + 1) / threadCount;
+        worker.pipelined = pipelined;
+        worker.inMemory = inMemory;
+        if (inMemory)
+        {
+            // lists and dictionary grow as needed, nothing is flushed
+            worker.memoryIndex.dictionary.allocate(termBytes, termCapacity);
+            continue;
+        }
+        for (int b = 0; b < bufferCount; ++b)
+        {
+            RunBuffer &run = worker.runBuffers[b];
+            run.postingBuffer.resize(postingCapacity);
+            run.sortBuffer.resize(postingCapacity);
+            run.dictionary.allocate(termBytes, termCapacity);
+        }
+    }
 
-    for (const auto &entry : pageTable)
+    // count first so docIds can be handed out in input order while the ranges are parsed in parallel
+    vector<thread> threads;
+    for (unsigned i = 0; i < threadCount; ++i)
     {
-        ofs << entry.first << '\t' << entry.second << '\n';
+        threads.emplace_back(countPassages, ref(workers[i]), cref(input));
+    }
+    for (thread &t : threads)
+    {
+        t.join();
+    }
+    threads.clear();
+    uint32_t nextDoc = 0;
+    for (ParseWorker &worker : workers)
+    {
+        worker.firstDoc = nextDoc;
+        nextDoc += worker.passageCount;
+    }
+
+    for (unsigned i = 0; i < threadCount; ++i)
+    {
+        threads.emplace_back(readFile, ref(workers[i]), cref(input));
+    }
+    for (thread &t : threads)
+    {
+        t.join();
     }
-    ofs.close();
 }
 
-int main()
+int main(int argc, char *argv[])
 {
     using namespace std::chrono;
     auto startTime = high_resolution_clock::now();
 
-    ifstream ifs;
+    // --threads 1 gives the old serial behavior
+    // --codec / --spanning-blocks as for index, only used by --in-memory
+    unsigned threadCount = max(1u, thread::hardware_concurrency());
+    size_t memoryBudgetMB = DEFAULT_MEMORY_BUDGET_MB;
     string inputFile = "subset_passages.tsv";
-    openFile(ifs, inputFile);
-    readFile(ifs);
-    if (postingBufferIndex > 0)
+    bool pipelined = false;
+    bool inMemory = false;
+    int codec = CODEC_AUTO;
+    bool termAligned = true;
+    for (int i = 1; i < argc; ++i)
     {
-        outputFile();
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+        {
+            threadCount = max(1, stoi(argv[++i]));
+        }
+        else if (arg == "--mem-mb" && i + 1 < argc)
+        {
+            memoryBudgetMB = max(1, stoi(argv[++i]));
+        }
+        else if (arg == "--input" && i + 1 < argc)
+        {
+            inputFile = argv[++i]; // e.g. collection.tsv for the full 8.8M passages
+        }
+        else if (arg == "--pipelined")
+        {
+            pipelined = true; // overlap sorting/writing a run with parsing the next one
+        }
+        else if (arg == "--in-memory")
+        {
+            inMemory = true; // build the index in this process, no temp files, merging or index step
+        }
+        else if (arg == "--codec" && i + 1 < argc)
+        {
+            codec = codecFromName(argv[++i]);
+            if (codec == CODEC_COUNT)
+            {
+                cerr << "Unknown codec " << argv[i] << ", use varbyte, bitpack, pfor, streamvbyte or auto" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--spanning-blocks")
+        {
+            termAligned = false;
+        }
+    }
+
+    vector<ParseWorker> workers;
+    parseInParallel(inputFile, threadCount, memoryBudgetMB * 1024 * 1024, pipelined, inMemory, workers);
+    outputPageTable(workers);
+    if (inMemory)
+    {
+        outputMemoryIndex(workers, codec, termAligned);
+    }
+    else
+    {
+        outputRunManifest(workers);
     }
-    outputPageTable();
-    ifs.close();
 
     auto endTime = high_resolution_clock::now();
     auto duration = duration_cast<milliseconds>(endTime - startTime).count();
     std::cout << "Elapsed time: " << duration << " ms" << std::endl;
+    if (inMemory)
+    {
+        std::cout << "Built index in memory using " << threadCount << " threads" << std::endl;
+    }
+    else
+    {
+        std::cout << "Wrote " << tempFileCount << " temp files using " << threadCount << " threads" << std::endl;
+    }
 
     return 0;
 }
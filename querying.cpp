@@ -7,28 +7,23 @@
 #include <cmath>
 #include <chrono>
 #include <iomanip>
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
 #include <unordered_set>
+#include <numeric>
+#include <limits>
+#include <thread>
+#include <atomic>
+#include "tokenizer.h"
+#include "index_writer.h" // BlockMetadata, LexiconEntry and the block codecs
+#include "impact_index.h" // ImpactLexiconEntry
+#include "front_coded_lexicon.h"
+#include "segment.h"     // index.seg, SegmentArray
 
 using namespace std;
 
-const double N = 1000000;
-const double k1 = 1.2;
-const double b = 0.75;
-const int k = 1000;
-
-struct BlockMetadata
-{
-    uint32_t lastDocId;
-    uint32_t docSize;  // compressed doc size
-    uint32_t freqSize; // compressed freq size
-};
-
-struct LexiconEntry
-{
-    uint32_t startBlock; // which block term starts in
-    uint32_t startIndex; // which index within block term start (0-127)
-    uint32_t listLength; // total postings for the term
-};
+const int k = 1000; // k1 and b are BM25_K1 and BM25_B in index_writer.h, N is the doc count of the page table
 
 struct ScoreDoc
 {
@@ -51,108 +46,197 @@ struct MinHeapComp
     }
 };
 
+// how a query's lists are traversed, all give the same results, maxscore and bmw need max_scores.bin
+enum Traversal
+{
+    TRAVERSAL_DAAT,     // disjunctiveDAAT, every candidate doc is scored
+    TRAVERSAL_MAXSCORE, // maxScoreDAAT
+    TRAVERSAL_BMW,      // blockMaxWAND
+    TRAVERSAL_SAAT      // impactSAAT on the impact index, quantized scores
+};
+
+// block-max bounds from max_scores.bin (or the segment), empty when the index has none (disjunctiveDAAT is used then)
+struct MaxScores
+{
+    SegmentArray<float> blocks; // per block, largest BM25 frequency part
+    SegmentArray<float> terms;  // per lexicon entry
+};
+
+// lexicon.bin.fc searched in place, term index -> LexiconEntry, extra() holds the inline postings
+typedef FrontCodedLexicon<LexiconEntry> Lexicon;
+
+// compressed postings mapped read-only, blocks are decoded straight out of the mapping instead of being read into a buffer
+struct Postings
+{
+    const unsigned char *data = nullptr; // block offsets count from here
+    bool prefetchLists = false;          // MADV_WILLNEED on a list's bytes when it is opened (with MADV_RANDOM on the rest)
+};
+
+// impact index for impactSAAT, read-only once loaded so all query threads share it
+struct ImpactIndex
+{
+    FrontCodedLexicon<ImpactLexiconEntry> lexicon;
+    MappedFile postings; // impact_index.bin
+};
+
+// one per query thread, reused across its queries and cleared through touched
+struct ImpactAccumulators
+{
+    vector<uint32_t> accumulators; // by docId, sized to the page table's doc count when the thread's accumulators are made
+    vector<uint32_t> touched;      // docIds with a nonzero accumulator
+};
+
 class ListPointer
 {
 public:
-    ListPointer(const string &term, const LexiconEntry &lexicon) : term(term), listLength(lexicon.listLength), blockNum(lexicon.startBlock), startBlock(lexicon.startBlock), startIndex(lexicon.startIndex)
+    ListPointer(const string &term, const LexiconEntry &lexicon, const unsigned char *inlinePostings, double docCount) : term(term), listLength(lexicon.listLength), idf(bm25Idf(lexicon.listLength, docCount)), blockNum(lexicon.startBlock), startBlock(lexicon.startBlock), startIndex(lexicon.startIndex)
     {
+        if (isInlineList(lexicon))
+        {
+            // short list kept in the lexicon (startBlock = its offset in the lexicon's extra bytes), decode it once, no block to load
+            inlineList = true;
+            const unsigned char *in = inlinePostings + lexicon.startBlock;
+            uint32_t prevDocId = 0;
+            for (uint32_t i = 0; i < listLength; ++i)
+            {
+                in = varbyteDecode(in, docIds[i]);
+                in = varbyteDecode(in, freqs[i]);
+                docIds[i] += prevDocId;
+                prevDocId = docIds[i];
+            }
+            blockSize = listLength;
+            freqsDecoded = true;
+            finalBlock = startBlock;
+            return;
+        }
         uint32_t postingsLeft = (lexicon.listLength > (128 - lexicon.startIndex)) ? (lexicon.listLength - (128 - lexicon.startIndex)) : 0;
         finalBlock = lexicon.startBlock + (postingsLeft + 127) / 128;
     }
 
-    // load 1 block of docIDs and freqs into ListPointer buffers
-    void loadBlock(ifstream &ifs, const vector<BlockMetadata> &metadata, const vector<uint64_t> &blockOffsets)
+    // load 1 block and decode all of its docIDs at once into the block array, freqs wait until a doc of the block is scored
+    void loadBlock(const Postings &postings, const SegmentArray<BlockMetadata> &metadata, const SegmentArray<uint64_t> &blockOffsets)
     {
+        if (inlineList)
+        {
+            return;
+        }
+        blockSize = 0;
+        blockPos = 0;
         if (blockNum >= metadata.size())
         {
             return;
         }
 
-        // seek and read compressed bytes from compressed inverted index at offset into buffer
-        ifs.clear();
-        ifs.seekg(blockOffsets[blockNum], ios::beg);
-
-        // compressed doc bytes
-        uint32_t docSize = metadata[blockNum].docSize;
-        docBuffer.resize(docSize);
-        ifs.read(reinterpret_cast<char *>(docBuffer.data()), docSize);
+        // the rest of the list will be read front to back, let the kernel start reading it in
+        if (postings.prefetchLists && !prefetched)
+        {
+            uint32_t lastBlock = min<uint32_t>(finalBlock, metadata.size() - 1);
+            const BlockMetadata &last = metadata[lastBlock];
+            adviseRange(postings.data, blockOffsets[blockNum], blockOffsets[lastBlock] + blockDocSize(last) + last.freqSize, MADV_WILLNEED);
+            prefetched = true;
+        }
 
-        // compressed freq bytes
-        uint32_t freqSize = metadata[blockNum].freqSize;
-        freqBuffer.resize(freqSize);
-        ifs.read(reinterpret_cast<char *>(freqBuffer.data()), freqSize);
+        // compressed doc bytes followed by compressed freq bytes, straight from the mapping
+        const BlockMetadata &block = metadata[blockNum];
+        blockData = postings.data + blockOffsets[blockNum];
 
-        docBufPos = 0;
-        freqBufPos = 0;
-        prevDocId = 0; // reset delta base when new block starts
+        // gaps -> docIDs, the delta base resets at every block
+        blockSize = decodeBlockPart(blockDocCodec(block), blockData, blockDocSize(block), docIds);
+        prefixSum(docIds, blockSize);
+        blockDocSizeBytes = blockDocSize(block);
+        blockFreqSizeBytes = block.freqSize;
+        blockFreqCodecId = blockFreqCodec(block);
+        freqsDecoded = false;
 
-        // skip docIDs before startIndex
-        if (blockNum == startBlock && startIndex > 0)
+        // skip the previous term's postings (spanning layout only, term-aligned lists start at 0)
+        if (blockNum == startBlock)
         {
-            for (uint32_t i = 0; i < startIndex; ++i)
-            {
-                uint32_t gap = varbyteDecode(docBuffer, docBufPos);
-                prevDocId += gap;
-                varbyteDecode(freqBuffer, freqBufPos);
-            }
+            blockPos = startIndex;
         }
-
-        currentPos = 0;
     }
 
-    uint32_t nextGEQ(uint32_t targetDoc, ifstream &ifs, const vector<BlockMetadata> &metadata, const vector<uint64_t> &blockOffsets)
+    uint32_t nextGEQ(uint32_t targetDoc, const Postings &postings, const SegmentArray<BlockMetadata> &metadata, const SegmentArray<uint64_t> &blockOffsets)
     {
-        if (currentPos >= listLength)
-        { // exhausted this term's postings
-            return UINT32_MAX;
+        // the rest of the current block is below targetDoc -> jump straight to the first block that can hold it
+        // (the final block is never skipped over, in the spanning layout its lastDocId can belong to the next term)
+        if (!inlineList && currentPos < listLength && blockNum < finalBlock && metadata[blockNum].lastDocId < targetDoc)
+        {
+            blockNum = skipBlocks(targetDoc, metadata);
+            currentPos = (128 - startIndex) + (blockNum - startBlock - 1) * 128; // postings of this term before blockNum
+            loadBlock(postings, metadata, blockOffsets);
         }
 
-        // linear decoding one by one
-        while (true)
+        // walk the decoded block arrays, never past this term's postings
+        while (currentPos < listLength)
         {
-            if (docBufPos >= docBuffer.size()) // need new block
+            if (blockPos >= blockSize) // need new block
             {
                 if (++blockNum > finalBlock || blockNum >= metadata.size())
                     return UINT32_MAX;
-                loadBlock(ifs, metadata, blockOffsets);
+                loadBlock(postings, metadata, blockOffsets);
+                continue;
             }
 
-            uint32_t gap = varbyteDecode(docBuffer, docBufPos);
-            uint32_t doc = prevDocId + gap;
-            prevDocId = doc;
-
-            uint32_t freq = varbyteDecode(freqBuffer, freqBufPos);
-
+            uint32_t doc = docIds[blockPos];
+            freqPending = true;
+            ++blockPos;
             ++currentPos;
             currentDoc = doc;
-            currentFreq = freq;
 
             if (doc >= targetDoc)
                 return doc;
         }
+        return UINT32_MAX; // exhausted this term's postings
     }
 
-    double getScore(double docLength, double averageDocLength) const
+    double getScore(double docLength, double averageDocLength)
     {
-        // BM25
-        double logNum = N - listLength + 0.5;
-        double logDenom = listLength + 0.5;
-        double operand_one = log(logNum / logDenom);
+        if (freqPending)
+        {
+            // first scored doc of this block decodes all its freqs
+            if (!freqsDecoded)
+            {
+                decodeBlockPart(blockFreqCodecId, blockData + blockDocSizeBytes, blockFreqSizeBytes, freqs);
+                freqsDecoded = true;
+            }
+            currentFreq = freqs[blockPos - 1];
+            freqPending = false;
+        }
 
-        double normalized_doc = docLength / averageDocLength;
-        double big_k = k1 * ((1 - b) + (b * normalized_doc));
-        double num = (k1 + 1) * currentFreq;
-        double denom = big_k + currentFreq;
-        double operand_two = num / denom;
+        // BM25
+        double operand_one = getIdf();
+        double operand_two = bm25FrequencyPart(currentFreq, docLength, averageDocLength);
 
         double score = operand_one * operand_two;
         return score;
     }
 
+    double getIdf() const
+    {
+        return idf;
+    }
+
+    // max frequency part of the block that would hold targetDoc (found like nextGEQ's skip, nothing is loaded)
+    // blockEnd = last docId that block covers, the final block is taken to cover everything since its lastDocId can belong to the next term
+    float getBlockMax(uint32_t targetDoc, const SegmentArray<BlockMetadata> &metadata, const SegmentArray<float> &blockMaxScores, float termMaxScore, uint32_t &blockEnd) const
+    {
+        if (inlineList)
+        {
+            blockEnd = UINT32_MAX - 1;
+            return termMaxScore;
+        }
+        uint32_t block = blockNum;
+        if (block < finalBlock && metadata[block].lastDocId < targetDoc)
+        {
+            block = skipBlocks(targetDoc, metadata);
+        }
+        blockEnd = block < finalBlock ? metadata[block].lastDocId : UINT32_MAX - 1;
+        return blockMaxScores[block];
+    }
+
     void close()
     {
-        docBuffer.clear();
-        freqBuffer.clear();
+        blockData = nullptr;
     }
 
     // needed to get maxscore approx
@@ -164,101 +248,316 @@ public:
     void setCurrentFrequency(uint32_t val)
     {
         currentFreq = val;
+        freqPending = false;
     }
 
 private:
-    uint32_t varbyteDecode(const vector<unsigned char> &buf, size_t &pos)
+    // first block after blockNum whose lastDocId >= targetDoc, or finalBlock
+    // gallop over the term's blocks (1, 2, 4, ... ahead) then binary search the last step, only metadata is read
+    uint32_t skipBlocks(uint32_t targetDoc, const SegmentArray<BlockMetadata> &metadata) const
     {
-        uint32_t num = 0;
-        uint32_t shift = 0;
-        uint8_t curr;
-
-        // varbyte is little endian, decode one num at a time
-        do
+        uint32_t lo = blockNum + 1;
+        uint32_t step = 1;
+        while (lo + step - 1 < finalBlock && metadata[lo + step - 1].lastDocId < targetDoc)
         {
-            curr = buf[pos++];
-            num += (curr & 127) << shift;
-            shift += 7;
-        } while (curr >= 128);
-
-        return num;
+            lo += step;
+            step *= 2;
+        }
+        uint32_t hi = min(lo + step - 1, finalBlock);
+        while (lo < hi)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (metadata[mid].lastDocId < targetDoc)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
     }
 
     string term;
     uint32_t listLength;     // total postings for term
+    double idf;              // from listLength and the collection's doc count
     uint32_t currentPos = 0; // curr index in postings list
     uint32_t currentDoc;     // most recent decoded docID, updated on nextGEQ
     uint32_t currentFreq;    // freq of term in currentDoc
     uint32_t blockNum;       // index of current COMPRESSED block in file (based on startBlock)
-    uint32_t finalBlock;     // prevents galloping from bleeding into next term's postings
+    uint32_t finalBlock;     // last block holding postings of this term, bounds the block skipping
     uint32_t startBlock;     // first block where term inverted list starts
     uint32_t startIndex;     // first index offset within start block
-    uint32_t prevDocId;      // for delta decoding varbyte
-    // buffers for curr block (compressed)
-    vector<unsigned char> docBuffer;  // to store compressed bytes from disk, read metadata[blockNum].docSize bytes
-    vector<unsigned char> freqBuffer; // to store compressed bytes from disk, read metadata[blockNum].freqSize bytes
-    // will decompress byte-by-byte when we need posting
-
-    // position inside compressed buffers (byte offset)
-    size_t docBufPos = 0;  // byte position inside current docBuffer, reset to 0 when load new block, indicates how far in buffer decoded, updated when decoding
-    size_t freqBufPos = 0; // byte position inside current freqBuffer, reset to 0 when load new block, indicates how far in buffer decoded, updated when decoding
+    // curr block, its compressed bytes in the mapping (doc part then freq part) and the whole block decoded
+    const unsigned char *blockData = nullptr;
+    uint32_t docIds[MAX_BUF_POSTINGS];
+    uint32_t freqs[MAX_BUF_POSTINGS];
+    uint32_t blockSize = 0; // postings decoded in the current block
+    uint32_t blockPos = 0;  // next posting of the current block
+    uint32_t blockDocSizeBytes = 0; // freq part starts here in blockData
+    uint32_t blockFreqSizeBytes = 0;
+    int blockFreqCodecId = CODEC_VARBYTE;
+    bool freqsDecoded = false; // freqs of the current block are in freqs[]
+    bool freqPending = false;  // currentFreq is not filled in for the current doc yet
+    bool inlineList = false;   // whole list decoded from the lexicon
+    bool prefetched = false;   // WILLNEED already issued for this list
 };
 
-vector<uint64_t> computeBlockOffsets(const vector<BlockMetadata> &metadata);
 vector<ScoreDoc> disjunctiveDAAT(const vector<string> &queryTerms,
-                                 const unordered_map<string, size_t> &termToIndex,
-                                 ifstream &ifs,
-                                 const vector<LexiconEntry> &lexicon,
-                                 const vector<BlockMetadata> &metadata,
-                                 const vector<uint64_t> &blockOffsets,
-                                 unordered_map<int, int> &pageTable,
-                                 double averageDocLength);
-unordered_map<int, int> loadPageTable(ifstream &ifs);
-double getAverageDocLength(const unordered_map<int, int> &pageTable);
-vector<LexiconEntry> loadLexicon(ifstream &ifs, unordered_map<string, size_t> &termToIndex);
+                                 const vector<size_t> &termIndexes,
+                                 const Postings &postings,
+                                 const Lexicon &lexicon,
+                                 const SegmentArray<BlockMetadata> &metadata,
+                                 const SegmentArray<uint64_t> &blockOffsets,
+                                 const SegmentArray<uint32_t> &docLengths,
+                                 double averageDocLength,
+                                 double docCount);
+vector<ScoreDoc> blockMaxWAND(const vector<string> &queryTerms,
+                              const vector<size_t> &termIndexes,
+                              const Postings &postings,
+                              const Lexicon &lexicon,
+                              const SegmentArray<BlockMetadata> &metadata,
+                              const SegmentArray<uint64_t> &blockOffsets,
+                              const MaxScores &maxScores,
+                              const SegmentArray<uint32_t> &docLengths,
+                              double averageDocLength,
+                              double docCount);
+vector<ScoreDoc> maxScoreDAAT(const vector<string> &queryTerms,
+                              const vector<size_t> &termIndexes,
+                              const Postings &postings,
+                              const Lexicon &lexicon,
+                              const SegmentArray<BlockMetadata> &metadata,
+                              const SegmentArray<uint64_t> &blockOffsets,
+                              const MaxScores &maxScores,
+                              const SegmentArray<uint32_t> &docLengths,
+                              double averageDocLength,
+                              double docCount);
+vector<size_t> scoringOrder(vector<ListPointer *> &lp, double averageDocLength, vector<double> &maxScores);
+vector<ScoreDoc> impactSAAT(const vector<size_t> &termIndexes, const ImpactIndex &impacts, ImpactAccumulators &accumulators, size_t postingBudget);
+vector<ScoreDoc> processImpactQuery(const string &query, const ImpactIndex &impacts, ImpactAccumulators &accumulators, size_t postingBudget);
+bool loadLexicon(ifstream &ifs, Lexicon &lexicon);
 vector<BlockMetadata> loadMetadata(ifstream &ifs);
+MaxScores loadMaxScores(ifstream &ifs, size_t blockCount, size_t termCount, vector<float> &storage);
 unordered_map<uint32_t, string> loadActualQueries(ifstream &ifs);
-void writeTrecResults(ofstream &ofs, uint32_t queryId, const vector<ScoreDoc> &rankedDocs, size_t k);
-void cleanQuery(string &query);
+void writeTrecResults(ofstream &ofs, uint32_t queryId, const vector<ScoreDoc> &rankedDocs, size_t k, const SegmentArray<uint32_t> &passageIds);
+template <typename RunQuery>
+vector<vector<ScoreDoc>> runQueryBatch(const vector<pair<uint32_t, string>> &queries, unsigned threadCount, RunQuery &runQuery);
 vector<ScoreDoc> processQuery(const string &query,
-                              uint32_t queryId,
-                              unordered_map<string, size_t> &termToIndex,
-                              ifstream &indexIfs,
-                              const vector<LexiconEntry> &lexicon,
-                              const vector<BlockMetadata> &metadata,
-                              const vector<uint64_t> &blockOffsets,
-                              unordered_map<int, int> &pageTable,
-                              double averageDocLength);
-
-int main()
+                              const Postings &postings,
+                              const Lexicon &lexicon,
+                              const SegmentArray<BlockMetadata> &metadata,
+                              const SegmentArray<uint64_t> &blockOffsets,
+                              const MaxScores &maxScores,
+                              Traversal traversal,
+                              const SegmentArray<uint32_t> &docLengths,
+                              double averageDocLength,
+                              double docCount);
+
+int main(int argc, char *argv[])
 {
-    // compressed index, lexicon, metadata, page table
-    string indexFilename = "compressed_inverted_index.bin";
-    string lexiconFilename = "lexicon.bin";
+    // --traversal daat|maxscore|bmw|saat, bmw (default) and maxscore fall back to daat if the index has no max_scores.bin
+    // saat reads the impact index from index --impact instead, --saat-postings P stops each query after P postings
+    // --segment reads everything from index.seg (index --segment), --verify-segment also checks its checksums
+    // --madvise random|sequential|normal access hint for the mapped postings, random (default) also prefetches each opened list
+    // --threads N query threads (default: one per core), the TREC files are the same for any N
+    Traversal traversal = TRAVERSAL_BMW;
+    size_t postingBudget = 0;
+    bool useSegment = false;
+    bool verifySegment = false;
+    int postingsAdvice = MADV_RANDOM;
+    unsigned threadCount = max(1u, thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--traversal" && i + 1 < argc)
+        {
+            string name = argv[++i];
+            if (name == "daat")
+                traversal = TRAVERSAL_DAAT;
+            else if (name == "maxscore")
+                traversal = TRAVERSAL_MAXSCORE;
+            else if (name == "bmw")
+                traversal = TRAVERSAL_BMW;
+            else if (name == "saat")
+                traversal = TRAVERSAL_SAAT;
+            else
+            {
+                cerr << "Unknown traversal " << name << ", use daat, maxscore, bmw or saat" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--saat-postings" && i + 1 < argc)
+        {
+            postingBudget = stoull(argv[++i]);
+        }
+        else if (arg == "--segment" || arg == "--verify-segment")
+        {
+            useSegment = true;
+            verifySegment = verifySegment || arg == "--verify-segment";
+        }
+        else if (arg == "--madvise" && i + 1 < argc)
+        {
+            string name = argv[++i];
+            if (name == "random")
+                postingsAdvice = MADV_RANDOM;
+            else if (name == "sequential")
+                postingsAdvice = MADV_SEQUENTIAL;
+            else if (name == "normal")
+                postingsAdvice = MADV_NORMAL;
+            else
+            {
+                cerr << "Unknown madvise hint " << name << ", use random, sequential or normal" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            threadCount = max(1, stoi(argv[++i]));
+        }
+    }
+    if (useSegment && traversal == TRAVERSAL_SAAT)
+    {
+        cerr << "index.seg holds the blocked index, saat reads the impact index files" << endl;
+        return 1;
+    }
+    auto startLoad = chrono::high_resolution_clock::now();
+
+    // compressed index, lexicon, metadata, page table (impact index and its lexicon for saat), or all of them in index.seg
+    string indexFilename = traversal == TRAVERSAL_SAAT ? "impact_index.bin" : "compressed_inverted_index.bin";
+    string lexiconFilename = traversal == TRAVERSAL_SAAT ? "impact_lexicon.bin" : "lexicon.bin";
     string metadataFilename = "metadata.bin";
     string pageTableFilename = "page_table.txt";
-    ifstream indexIfs(indexFilename, ios::binary);
-    ifstream lexiconIfs(lexiconFilename, ios::binary);
-    ifstream metadataIfs(metadataFilename, ios::binary);
-    ifstream pageTableIfs(pageTableFilename);
-
-    if (!indexIfs || !lexiconIfs || !metadataIfs || !pageTableIfs)
+    string segmentFilename = "index.seg";
+
+    Lexicon lexicon;
+    Postings postings;
+    MappedFile postingsFile;
+    SegmentArray<BlockMetadata> metadata;
+    SegmentArray<uint64_t> blockOffsets;
+    SegmentArray<uint32_t> docLengths;
+    SegmentArray<uint32_t> passageIds; // by docId, empty for an index built on passage ids
+    MappedFile passageIdsFile;
+    double averageDocLength = 0;
+    uint64_t docCount = 0; // BM25's N
+    MaxScores maxScores;
+    ImpactIndex impacts;
+    Segment segment;
+    // backing storage when the separate files are read, the arrays above point into these
+    vector<BlockMetadata> metadataStorage;
+    vector<uint64_t> blockOffsetStorage;
+    vector<uint32_t> docLengthStorage;
+    vector<float> maxScoreStorage;
+    if (useSegment)
     {
-        cerr << "Failed to open files!" << endl;
-        return 1;
+        // nothing to parse, every structure points into the mapping
+        if (!segment.open(segmentFilename) || (verifySegment && !segment.verify()) ||
+            !lexicon.attach(segment.bytes(SECTION_LEXICON), segment.size(SECTION_LEXICON)))
+        {
+            return 1;
+        }
+        // block offsets in index.seg count from the start of the file
+        postings.data = segment.data();
+        segment.advise(SECTION_POSTINGS, postingsAdvice);
+        metadata = segment.array<BlockMetadata>(SECTION_METADATA);
+        blockOffsets = segment.array<uint64_t>(SECTION_BLOCK_OFFSETS);
+        docLengths = segment.array<uint32_t>(SECTION_DOC_LENGTHS);
+        passageIds = segment.array<uint32_t>(SECTION_DOC_IDS);
+        averageDocLength = segment.averageDocLength();
+        docCount = segment.docCount();
+        SegmentArray<float> bounds = segment.array<float>(SECTION_MAX_SCORES);
+        if (traversal != TRAVERSAL_DAAT && bounds.size() == metadata.size() + lexicon.size())
+        {
+            maxScores.blocks = SegmentArray<float>(bounds.data(), metadata.size());
+            maxScores.terms = SegmentArray<float>(bounds.data() + metadata.size(), lexicon.size());
+        }
+    }
+    else
+    {
+        // put doc lengths in memory, indexed by docId
+        if (!loadDocLengths(pageTableFilename, docLengthStorage, averageDocLength, &docCount))
+        {
+            cerr << "Failed to open " << pageTableFilename << endl;
+            return 1;
+        }
+        docLengths = docLengthStorage;
+        if (passageIdsFile.open("doc_ids.bin", MADV_RANDOM))
+        {
+            passageIds = SegmentArray<uint32_t>(reinterpret_cast<const uint32_t *>(passageIdsFile.data), passageIdsFile.size / sizeof(uint32_t));
+        }
     }
 
-    // put page table in memory
-    unordered_map<int, int> pageTable = loadPageTable(pageTableIfs);
-    double averageDocLength = getAverageDocLength(pageTable);
+    if (traversal == TRAVERSAL_SAAT)
+    {
+        if (!impacts.postings.open(indexFilename, postingsAdvice) || !impacts.lexicon.open(lexiconFilename))
+        {
+            cerr << "Failed to open " << indexFilename << " or " << lexiconFilename << endl;
+            return 1;
+        }
+    }
+    else if (!useSegment)
+    {
+        // postings are decoded straight out of the mapping
+        if (!postingsFile.open(indexFilename, postingsAdvice))
+        {
+            cerr << "Failed to open " << indexFilename << endl;
+            return 1;
+        }
+        postings.data = reinterpret_cast<const unsigned char *>(postingsFile.data);
 
-    // put lexicon in memory and have mapping from term to index
-    unordered_map<string, size_t> termToIndex;
-    vector<LexiconEntry> lexicon = loadLexicon(lexiconIfs, termToIndex);
+        // front-coded lexicon is mapped and searched in place, an older index only has lexicon.bin which is converted
+        if (!lexicon.open(frontCodedLexiconFile(lexiconFilename)))
+        {
+            ifstream lexiconIfs(lexiconFilename, ios::binary);
+            if (!lexiconIfs || !loadLexicon(lexiconIfs, lexicon))
+            {
+                cerr << "Failed to open " << lexiconFilename << endl;
+                return 1;
+            }
+        }
 
-    // process metadata in memory
-    vector<BlockMetadata> metadata = loadMetadata(metadataIfs);
-    vector<uint64_t> blockOffsets = computeBlockOffsets(metadata);
+        // process metadata in memory
+        ifstream metadataIfs(metadataFilename, ios::binary);
+        if (!metadataIfs)
+        {
+            cerr << "Failed to open " << metadataFilename << endl;
+            return 1;
+        }
+        metadataStorage = loadMetadata(metadataIfs);
+        blockOffsetStorage = computeBlockOffsets(metadataStorage);
+        metadata = metadataStorage;
+        blockOffsets = blockOffsetStorage;
+
+        // block and term score bounds for maxScoreDAAT and blockMaxWAND, optional
+        ifstream maxScoresIfs("max_scores.bin", ios::binary);
+        if (traversal != TRAVERSAL_DAAT && maxScoresIfs)
+        {
+            maxScores = loadMaxScores(maxScoresIfs, metadata.size(), lexicon.size(), maxScoreStorage);
+        }
+    }
+    if (traversal != TRAVERSAL_SAAT && maxScores.terms.empty())
+    {
+        traversal = TRAVERSAL_DAAT;
+    }
+    postings.prefetchLists = postingsAdvice == MADV_RANDOM;
+    auto endLoad = chrono::high_resolution_clock::now();
+    cout << "Index loaded in " << chrono::duration_cast<chrono::milliseconds>(endLoad - startLoad).count() << " ms" << endl;
+    const char *traversalNames[] = {"Exhaustive DAAT", "MaxScore", "Block-Max WAND", "Score-at-a-time (impacts)"};
+    cout << traversalNames[traversal] << " query processing on " << threadCount << " thread(s)" << endl;
+
+    // the index is only read from here on, the saat accumulators are the only state kept between queries so every thread has its own
+    vector<ImpactAccumulators> threadAccumulators(threadCount);
+    if (traversal == TRAVERSAL_SAAT)
+    {
+        for (ImpactAccumulators &accumulators : threadAccumulators)
+        {
+            accumulators.accumulators.assign(docLengths.size(), 0);
+        }
+    }
+    auto runQuery = [&](const string &query, unsigned thread)
+    {
+        if (traversal == TRAVERSAL_SAAT)
+        {
+            return processImpactQuery(query, impacts, threadAccumulators[thread], postingBudget);
+        }
+        return processQuery(query, postings, lexicon, metadata, blockOffsets, maxScores, traversal, docLengths, averageDocLength, docCount);
+    };
 
     // get query
     string queryInput;
@@ -284,15 +583,13 @@ int main()
     unordered_map<uint32_t, string> devQueryMap = loadActualQueries(devActualIfs);
     unordered_map<uint32_t, string> evalQueryMap = loadActualQueries(evalActualIfs);
 
-    string query;
     string line;
     int ignore;
     uint32_t queryId;
     uint32_t passageId;
-    uint8_t relevance;                               // 0-3
-    vector<pair<uint32_t, vector<ScoreDoc>>> buffer; // stpre 100 queries at a time
+    uint8_t relevance;                    // 0-3
+    vector<pair<uint32_t, string>> batch; // queryId, query
     unordered_set<uint32_t> uniqueQueries;
-    uint32_t counter = 0;
 
     string devTrecTop100Filename = "bm25.dev.top100.trec";
     string devTrecTop1000Filename = "bm25.dev.top1000.trec";
@@ -303,6 +600,27 @@ int main()
     string evalTwoTrecTop100Filename = "bm25.eval.two.top100.trec";
     string evalTwoTrecTop1000Filename = "bm25.eval.two.top1000.trec";
 
+    // queries in uniqueQueries order, so the output order does not depend on the thread count
+    auto collectQueries = [&](const unordered_map<uint32_t, string> &queryMap)
+    {
+        batch.clear();
+        for (uint32_t id : uniqueQueries)
+        {
+            auto it = queryMap.find(id);
+            batch.push_back({id, it != queryMap.end() ? it->second : string()});
+        }
+        uniqueQueries.clear();
+    };
+    auto writeBatch = [&](ofstream &ofs100, ofstream &ofs1000, const vector<pair<uint32_t, string>> &queries,
+                          const vector<vector<ScoreDoc>> &results)
+    {
+        for (size_t i = 0; i < queries.size(); ++i)
+        {
+            writeTrecResults(ofs100, queries[i].first, results[i], 100, passageIds);
+            writeTrecResults(ofs1000, queries[i].first, results[i], 1000, passageIds);
+        }
+    };
+
     // qrels.dev.tsv
     cout << "Processing qrels.dev.tsv" << endl;
     ofstream ofsTop100(devTrecTop100Filename);
@@ -314,33 +632,17 @@ int main()
         ss >> queryId >> passageId >> relevance;
         uniqueQueries.insert(queryId);
     }
+    collectQueries(devQueryMap);
 
+    // flushed to disk 100 queries per thread at a time
     auto startDev = chrono::high_resolution_clock::now();
-    for (uint32_t queryId : uniqueQueries)
-    {
-        query = devQueryMap[queryId];
-        vector<ScoreDoc> results = processQuery(query, queryId, termToIndex, indexIfs, lexicon, metadata, blockOffsets, pageTable, averageDocLength);
-
-        buffer.push_back({queryId, results});
-        ++counter;
-
-        if (counter % 100 == 0)
-        {
-            for (const auto &entry : buffer)
-            {
-                writeTrecResults(ofsTop100, entry.first, entry.second, 100);
-                writeTrecResults(ofsTop1000, entry.first, entry.second, 1000);
-            }
-            buffer.clear();
-            cout << "Flushed 100 queries to disk." << endl;
-        }
-    }
-
-    // remaining ones (if < 100 left)
-    for (const auto &entry : buffer)
+    size_t chunkSize = 100 * (size_t)threadCount;
+    for (size_t start = 0; start < batch.size(); start += chunkSize)
     {
-        writeTrecResults(ofsTop100, entry.first, entry.second, 100);
-        writeTrecResults(ofsTop1000, entry.first, entry.second, 1000);
+        vector<pair<uint32_t, string>> chunk(batch.begin() + start, batch.begin() + min(batch.size(), start + chunkSize));
+        vector<vector<ScoreDoc>> results = runQueryBatch(chunk, threadCount, runQuery);
+        writeBatch(ofsTop100, ofsTop1000, chunk, results);
+        cout << "Flushed " << chunk.size() << " queries to disk." << endl;
     }
 
     auto endDev = chrono::high_resolution_clock::now();
@@ -348,8 +650,6 @@ int main()
     cout << "✅ Finished writing dev TREC files in " << fixed << setprecision(2)
          << elapsedDev << " seconds.\n";
 
-    buffer.clear();
-    uniqueQueries.clear();
     ofsTop100.close();
     ofsTop1000.close();
     cout << "Flushed final queries to disk." << endl;
@@ -365,29 +665,17 @@ int main()
         ss >> queryId >> ignore >> passageId >> relevance;
         uniqueQueries.insert(queryId);
     }
+    collectQueries(evalQueryMap);
 
     auto startEvalOne = chrono::high_resolution_clock::now();
 
-    for (uint32_t queryId : uniqueQueries)
-    {
-        query = evalQueryMap[queryId];
-        vector<ScoreDoc> results = processQuery(query, queryId, termToIndex, indexIfs, lexicon, metadata, blockOffsets, pageTable, averageDocLength);
-        buffer.push_back({queryId, results});
-    }
-
-    for (const auto &entry : buffer)
-    {
-        writeTrecResults(ofsTop100, entry.first, entry.second, 100);
-        writeTrecResults(ofsTop1000, entry.first, entry.second, 1000);
-    }
+    writeBatch(ofsTop100, ofsTop1000, batch, runQueryBatch(batch, threadCount, runQuery));
 
     auto endEvalOne = chrono::high_resolution_clock::now();
     double elapsedEvalOne = chrono::duration<double>(endEvalOne - startEvalOne).count();
     cout << "✅ Finished writing eval.one TREC files in " << fixed << setprecision(2)
          << elapsedEvalOne << " seconds.\n";
 
-    buffer.clear();
-    uniqueQueries.clear();
     ofsTop100.close();
     ofsTop1000.close();
     cout << "Flushed final queries to disk." << endl;
@@ -403,36 +691,20 @@ int main()
         ss >> queryId >> ignore >> passageId >> relevance;
         uniqueQueries.insert(queryId);
     }
+    collectQueries(evalQueryMap);
 
     auto startEvalTwo = chrono::high_resolution_clock::now();
 
-    for (uint32_t queryId : uniqueQueries)
-    {
-        query = evalQueryMap[queryId];
-        vector<ScoreDoc> results = processQuery(query, queryId, termToIndex, indexIfs, lexicon, metadata, blockOffsets, pageTable, averageDocLength);
-        buffer.push_back({queryId, results});
-    }
-
-    for (const auto &entry : buffer)
-    {
-        writeTrecResults(ofsTop100, entry.first, entry.second, 100);
-        writeTrecResults(ofsTop1000, entry.first, entry.second, 1000);
-    }
+    writeBatch(ofsTop100, ofsTop1000, batch, runQueryBatch(batch, threadCount, runQuery));
 
     auto endEvalTwo = chrono::high_resolution_clock::now();
     double elapsedEvalTwo = chrono::duration<double>(endEvalTwo - startEvalTwo).count();
     cout << "✅ Finished writing eval.two TREC files in " << fixed << setprecision(2)
          << elapsedEvalTwo << " seconds.\n";
 
-    buffer.clear();
-    uniqueQueries.clear();
     cout << "Flushed all queries to disk." << endl;
 
     // close all filestreams
-    indexIfs.close();
-    lexiconIfs.close();
-    metadataIfs.close();
-    pageTableIfs.close();
     devIfs.close();
     evalOneIfs.close();
     evalTwoIfs.close();
@@ -440,28 +712,15 @@ int main()
     evalActualIfs.close();
 }
 
-// compute block offsets once from metadata for each block instead of doing it each time we get a term
-vector<uint64_t> computeBlockOffsets(const vector<BlockMetadata> &metadata)
-{
-    // basically prefix sums
-    vector<uint64_t> offsets(metadata.size());
-    uint64_t off = 0;
-    for (size_t i = 0; i < metadata.size(); ++i)
-    {
-        offsets[i] = off;
-        off += (uint64_t)metadata[i].docSize + (uint64_t)metadata[i].freqSize;
-    }
-    return offsets;
-}
-
 vector<ScoreDoc> disjunctiveDAAT(const vector<string> &queryTerms,
-                                 const unordered_map<string, size_t> &termToIndex,
-                                 ifstream &ifs,
-                                 const vector<LexiconEntry> &lexicon,
-                                 const vector<BlockMetadata> &metadata,
-                                 const vector<uint64_t> &blockOffsets,
-                                 unordered_map<int, int> &pageTable,
-                                 double averageDocLength)
+                                 const vector<size_t> &termIndexes,
+                                 const Postings &postings,
+                                 const Lexicon &lexicon,
+                                 const SegmentArray<BlockMetadata> &metadata,
+                                 const SegmentArray<uint64_t> &blockOffsets,
+                                 const SegmentArray<uint32_t> &docLengths,
+                                 double averageDocLength,
+                                 double docCount)
 {
     size_t numTerms = queryTerms.size();
     // iterate over union of postings, compute
@@ -470,39 +729,20 @@ vector<ScoreDoc> disjunctiveDAAT(const vector<string> &queryTerms,
     // open all lists
     for (size_t i = 0; i < numTerms; ++i)
     {
-        ListPointer *p = new ListPointer(queryTerms[i], lexicon[termToIndex.at(queryTerms[i])]);
-        p->loadBlock(ifs, metadata, blockOffsets);
+        ListPointer *p = new ListPointer(queryTerms[i], lexicon.entry(termIndexes[i]), lexicon.extra(), docCount);
+        p->loadBlock(postings, metadata, blockOffsets);
         lp[i] = p;
     }
 
-    // sort posting lists by max possible impact score to identify essential lists
-    // don't want to decode each frequency to find max, so just use listLength to set upper bound
-    vector<double> maxScores(numTerms);
-    for (size_t i = 0; i < numTerms; ++i)
-    {
-        // assume highest freq is listLength (max possible freq)
-        // approx upper bound for each list
-        uint32_t listLength = lp[i]->getListLength();
-        lp[i]->setCurrentFrequency(listLength);
-        // pageTable[8841709] arbitrarily chosen for length normalization since don't know "true" docId yet
-        maxScores[i] = lp[i]->getScore(pageTable[8841709], averageDocLength);
-    }
-
-    // sort from lowest to highest impact
     // if sum of remaining maxScores (of higher ones) < threshold, can stop early
-    vector<size_t> order(numTerms);
-    for (size_t i = 0; i < numTerms; ++i)
-    {
-        order[i] = i;
-    }
-    sort(order.begin(), order.end(), [&](size_t a, size_t b)
-         { return maxScores[a] < maxScores[b]; });
+    vector<double> maxScores;
+    vector<size_t> order = scoringOrder(lp, averageDocLength, maxScores);
 
     // keep track of curr docIDs in each list
     vector<uint32_t> currDoc(numTerms);
     for (size_t i = 0; i < numTerms; ++i)
     {
-        currDoc[i] = lp[i]->nextGEQ(0, ifs, metadata, blockOffsets);
+        currDoc[i] = lp[i]->nextGEQ(0, postings, metadata, blockOffsets);
     }
 
     // use min heap so we take out minimum out of the top k in constant time
@@ -533,14 +773,14 @@ vector<ScoreDoc> disjunctiveDAAT(const vector<string> &queryTerms,
             // if one of it matches, can add to score, not necessarily all inverted lists need to have it, so we put those in remainingMax
             if (currDoc[idx] == candidate)
             {
-                score += lp[idx]->getScore(pageTable[candidate], averageDocLength);
+                score += lp[idx]->getScore(docLengths[candidate], averageDocLength);
 
                 // advance list to meet >= candidate + 1, so basically next docID
-                currDoc[idx] = lp[idx]->nextGEQ(candidate + 1, ifs, metadata, blockOffsets);
+                currDoc[idx] = lp[idx]->nextGEQ(candidate + 1, postings, metadata, blockOffsets);
             }
             else
             {
-                remainingMax += maxScores[idx];
+                remainingMax += max(maxScores[idx], 0.0); // a negative idf bound would skip docs that beat the heap
             }
         }
 
@@ -577,44 +817,466 @@ vector<ScoreDoc> disjunctiveDAAT(const vector<string> &queryTerms,
     return results;
 }
 
-unordered_map<int, int> loadPageTable(ifstream &ifs)
+// sort posting lists by max possible impact score to identify essential lists
+// every traversal sums a doc's term scores in this order, so they all produce bit-identical scores
+vector<size_t> scoringOrder(vector<ListPointer *> &lp, double averageDocLength, vector<double> &maxScores)
+{
+    size_t numTerms = lp.size();
+    // don't want to decode each frequency to find max, so just use listLength to set upper bound
+    maxScores.assign(numTerms, 0.0);
+    for (size_t i = 0; i < numTerms; ++i)
+    {
+        // assume highest freq is listLength (max possible freq)
+        // approx upper bound for each list
+        uint32_t listLength = lp[i]->getListLength();
+        lp[i]->setCurrentFrequency(listLength);
+        // doc length 0 arbitrarily chosen for length normalization since don't know "true" docId yet
+        // (was the length of passage 8841709, which is not in the subset, and docIds are internal now)
+        maxScores[i] = lp[i]->getScore(0, averageDocLength);
+    }
+
+    // sort from lowest to highest impact
+    vector<size_t> order(numTerms);
+    for (size_t i = 0; i < numTerms; ++i)
+    {
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [&](size_t a, size_t b)
+         { return maxScores[a] < maxScores[b]; });
+    return order;
+}
+
+// MaxScore: lists sorted by term bound, the lowest ones whose bounds add up to <= the heap top are non-essential,
+// a doc that is only in those can't make it into the top k, so candidates come from the essential lists only
+// and the non-essential lists are probed (highest bound first) only while the partial score can still beat the heap top
+// docs are scored in docId order and summed in scoringOrder like disjunctiveDAAT, so the results are identical
+vector<ScoreDoc> maxScoreDAAT(const vector<string> &queryTerms,
+                              const vector<size_t> &termIndexes,
+                              const Postings &postings,
+                              const Lexicon &lexicon,
+                              const SegmentArray<BlockMetadata> &metadata,
+                              const SegmentArray<uint64_t> &blockOffsets,
+                              const MaxScores &maxScores,
+                              const SegmentArray<uint32_t> &docLengths,
+                              double averageDocLength,
+                              double docCount)
+{
+    size_t numTerms = queryTerms.size();
+    vector<ListPointer *> lp(numTerms);
+    vector<double> termBound(numTerms);
+    for (size_t i = 0; i < numTerms; ++i)
+    {
+        size_t termIndex = termIndexes[i];
+        lp[i] = new ListPointer(queryTerms[i], lexicon.entry(termIndex), lexicon.extra(), docCount);
+        lp[i]->loadBlock(postings, metadata, blockOffsets);
+        termBound[i] = max(lp[i]->getIdf(), 0.0) * maxScores.terms[termIndex];
+    }
+
+    vector<double> estimates;
+    vector<size_t> order = scoringOrder(lp, averageDocLength, estimates);
+
+    // lists from lowest to highest bound, prefixBound[i] = bound of a doc only in byBound[0..i]
+    vector<size_t> byBound(numTerms);
+    for (size_t i = 0; i < numTerms; ++i)
+    {
+        byBound[i] = i;
+    }
+    sort(byBound.begin(), byBound.end(), [&](size_t a, size_t b)
+         { return termBound[a] < termBound[b]; });
+    vector<double> prefixBound(numTerms);
+    double sum = 0.0;
+    for (size_t i = 0; i < numTerms; ++i)
+    {
+        sum += termBound[byBound[i]];
+        prefixBound[i] = sum;
+    }
+
+    vector<uint32_t> currDoc(numTerms);
+    for (size_t i = 0; i < numTerms; ++i)
+    {
+        currDoc[i] = lp[i]->nextGEQ(0, postings, metadata, blockOffsets);
+    }
+
+    vector<double> termScores(numTerms);
+    vector<bool> matched(numTerms);
+    size_t firstEssential = 0; // byBound[0..firstEssential) are non-essential, only grows since the heap top only grows
+    priority_queue<ScoreDoc, vector<ScoreDoc>, MinHeapComp> topK;
+
+    while (true)
+    {
+        double threshold = topK.size() < k ? numeric_limits<double>::lowest() : topK.top().score;
+        while (firstEssential < numTerms && prefixBound[firstEssential] <= threshold)
+        {
+            ++firstEssential;
+        }
+        if (firstEssential == numTerms)
+        {
+            break; // even a doc in every list can't beat the heap top
+        }
+
+        // next candidate = min docID of the essential lists
+        uint32_t candidate = UINT32_MAX;
+        for (size_t i = firstEssential; i < numTerms; ++i)
+        {
+            candidate = min(candidate, currDoc[byBound[i]]);
+        }
+        if (candidate == UINT32_MAX)
+        {
+            break; // essential lists exhausted
+        }
+
+        // essential lists are always scored and moved on
+        double partial = 0.0;
+        fill(matched.begin(), matched.end(), false);
+        for (size_t i = firstEssential; i < numTerms; ++i)
+        {
+            size_t idx = byBound[i];
+            if (currDoc[idx] == candidate)
+            {
+                termScores[idx] = lp[idx]->getScore(docLengths[candidate], averageDocLength);
+                partial += termScores[idx];
+                matched[idx] = true;
+                currDoc[idx] = lp[idx]->nextGEQ(candidate + 1, postings, metadata, blockOffsets);
+            }
+        }
+
+        // non-essential lists, highest bound first, stop once the rest can't lift the doc above the heap top
+        bool pruned = false;
+        for (size_t i = firstEssential; i-- > 0;)
+        {
+            if (partial + prefixBound[i] <= threshold)
+            {
+                pruned = true;
+                break;
+            }
+            size_t idx = byBound[i];
+            if (currDoc[idx] < candidate)
+            {
+                currDoc[idx] = lp[idx]->nextGEQ(candidate, postings, metadata, blockOffsets);
+            }
+            if (currDoc[idx] == candidate)
+            {
+                termScores[idx] = lp[idx]->getScore(docLengths[candidate], averageDocLength);
+                partial += termScores[idx];
+                matched[idx] = true;
+            }
+        }
+        if (pruned)
+        {
+            continue;
+        }
+
+        // final score summed in the same order as the exhaustive traversal
+        double score = 0.0;
+        for (size_t idx : order)
+        {
+            if (matched[idx])
+            {
+                score += termScores[idx];
+            }
+        }
+
+        if (topK.size() < k)
+        {
+            topK.push({score, candidate});
+        }
+        else if (score > topK.top().score)
+        {
+            topK.pop();
+            topK.push({score, candidate});
+        }
+    }
+
+    for (size_t idx = 0; idx < lp.size(); ++idx)
+    {
+        lp[idx]->close();
+        delete lp[idx];
+    }
+
+    vector<ScoreDoc> results;
+    while (!topK.empty())
+    {
+        results.push_back(topK.top());
+        topK.pop();
+    }
+    return results;
+}
+
+// Block-Max WAND: same top k as disjunctiveDAAT without scoring every candidate
+// lists are kept sorted by current docId, the pivot is the first list where the summed term bounds beat the heap top,
+// the pivot doc is only scored when the bounds of the blocks holding it beat the heap top too,
+// otherwise every list up to the pivot jumps past the nearest block end without loading the skipped blocks
+// docs are still scored in docId order with their term scores summed in scoringOrder, and a doc is only skipped when
+// its bound is <= the heap top (the exhaustive heap only takes score > top), so the results are identical
+vector<ScoreDoc> blockMaxWAND(const vector<string> &queryTerms,
+                              const vector<size_t> &termIndexes,
+                              const Postings &postings,
+                              const Lexicon &lexicon,
+                              const SegmentArray<BlockMetadata> &metadata,
+                              const SegmentArray<uint64_t> &blockOffsets,
+                              const MaxScores &maxScores,
+                              const SegmentArray<uint32_t> &docLengths,
+                              double averageDocLength,
+                              double docCount)
 {
-    unordered_map<int, int> table;
-    int docId;
-    int docLength;
-    while (ifs >> docId >> docLength)
+    size_t numTerms = queryTerms.size();
+    vector<ListPointer *> lp(numTerms);
+    vector<float> termMax(numTerms);
+    for (size_t i = 0; i < numTerms; ++i)
+    {
+        size_t termIndex = termIndexes[i];
+        lp[i] = new ListPointer(queryTerms[i], lexicon.entry(termIndex), lexicon.extra(), docCount);
+        lp[i]->loadBlock(postings, metadata, blockOffsets);
+        termMax[i] = maxScores.terms[termIndex];
+    }
+
+    vector<double> estimates;
+    vector<size_t> order = scoringOrder(lp, averageDocLength, estimates);
+
+    // stored bounds are frequency parts, times idf they bound the term score (idf < 0 only lowers scores -> bound 0)
+    vector<double> idf(numTerms);
+    vector<double> termBound(numTerms);
+    for (size_t i = 0; i < numTerms; ++i)
+    {
+        idf[i] = max(lp[i]->getIdf(), 0.0);
+        termBound[i] = idf[i] * termMax[i];
+    }
+
+    vector<uint32_t> currDoc(numTerms);
+    vector<size_t> sorted(numTerms); // lists by current docId
+    for (size_t i = 0; i < numTerms; ++i)
+    {
+        currDoc[i] = lp[i]->nextGEQ(0, postings, metadata, blockOffsets);
+        sorted[i] = i;
+    }
+
+    priority_queue<ScoreDoc, vector<ScoreDoc>, MinHeapComp> topK;
+
+    while (true)
+    {
+        sort(sorted.begin(), sorted.end(), [&](size_t a, size_t b)
+             { return currDoc[a] < currDoc[b]; });
+
+        // until the heap is full every doc gets in
+        double threshold = topK.size() < k ? numeric_limits<double>::lowest() : topK.top().score;
+
+        // pivot: docs before pivotDoc are only in lists whose bounds together can't beat the threshold
+        double bound = 0.0;
+        size_t pivot = numTerms;
+        for (size_t i = 0; i < numTerms && currDoc[sorted[i]] != UINT32_MAX; ++i)
+        {
+            bound += termBound[sorted[i]];
+            if (bound > threshold)
+            {
+                pivot = i;
+                break;
+            }
+        }
+        if (pivot == numTerms)
+        {
+            break; // nothing left can make it into the top k
+        }
+        uint32_t pivotDoc = currDoc[sorted[pivot]];
+        while (pivot + 1 < numTerms && currDoc[sorted[pivot + 1]] == pivotDoc)
+        {
+            ++pivot;
+        }
+
+        // block bounds of the lists up to the pivot at pivotDoc, and the first doc after the nearest block end
+        double blockBound = 0.0;
+        uint32_t nextDoc = pivot + 1 < numTerms ? currDoc[sorted[pivot + 1]] : UINT32_MAX;
+        for (size_t i = 0; i <= pivot; ++i)
+        {
+            size_t idx = sorted[i];
+            uint32_t blockEnd;
+            blockBound += idf[idx] * lp[idx]->getBlockMax(pivotDoc, metadata, maxScores.blocks, termMax[idx], blockEnd);
+            nextDoc = min(nextDoc, blockEnd + 1);
+        }
+
+        if (blockBound <= threshold)
+        {
+            // no doc before nextDoc can beat the threshold in these blocks
+            for (size_t i = 0; i <= pivot; ++i)
+            {
+                currDoc[sorted[i]] = lp[sorted[i]]->nextGEQ(nextDoc, postings, metadata, blockOffsets);
+            }
+        }
+        else if (currDoc[sorted[0]] != pivotDoc)
+        {
+            // move the lists before the pivot up to pivotDoc
+            for (size_t i = 0; i < pivot && currDoc[sorted[i]] < pivotDoc; ++i)
+            {
+                currDoc[sorted[i]] = lp[sorted[i]]->nextGEQ(pivotDoc, postings, metadata, blockOffsets);
+            }
+        }
+        else
+        {
+            // every list holding pivotDoc is on it: score it like disjunctiveDAAT
+            double score = 0.0;
+            for (size_t idx : order)
+            {
+                if (currDoc[idx] == pivotDoc)
+                {
+                    score += lp[idx]->getScore(docLengths[pivotDoc], averageDocLength);
+                    currDoc[idx] = lp[idx]->nextGEQ(pivotDoc + 1, postings, metadata, blockOffsets);
+                }
+            }
+
+            if (topK.size() < k)
+            {
+                topK.push({score, pivotDoc});
+            }
+            else if (score > topK.top().score)
+            {
+                topK.pop();
+                topK.push({score, pivotDoc});
+            }
+        }
+    }
+
+    for (size_t idx = 0; idx < lp.size(); ++idx)
     {
-        table[docId] = docLength;
+        lp[idx]->close();
+        delete lp[idx];
     }
-    return table;
+
+    vector<ScoreDoc> results;
+    while (!topK.empty())
+    {
+        results.push_back(topK.top());
+        topK.pop();
+    }
+    return results;
 }
 
-double getAverageDocLength(const unordered_map<int, int> &pageTable)
+// SCORE-AT-A-TIME over the impact index (see impact_index.h)
+// every query term's segments are read, then processed highest impact first, adding integer impacts into a dense
+// accumulator per docId, so there is no BM25 math at query time; after postingBudget postings (0 = no limit) it stops early
+vector<ScoreDoc> impactSAAT(const vector<size_t> &termIndexes, const ImpactIndex &impacts, ImpactAccumulators &accumulators, size_t postingBudget)
 {
-    uint64_t total = 0;
-    for (const auto &entry : pageTable)
+    struct Segment
+    {
+        uint8_t impact;
+        uint32_t count;
+        const unsigned char *docs; // count varbyte gaps
+    };
+
+    // find each term's segments in the mapping from their headers, no posting is decoded before it is scored
+    vector<Segment> segments;
+    uint32_t maxDocId = 0;
+    for (size_t i = 0; i < termIndexes.size(); ++i)
+    {
+        const ImpactLexiconEntry &entry = impacts.lexicon.entry(termIndexes[i]);
+        const unsigned char *in = reinterpret_cast<const unsigned char *>(impacts.postings.data) + entry.offset;
+        const unsigned char *end = in + entry.size;
+        while (in < end)
+        {
+            Segment segment;
+            uint32_t bytes;
+            segment.impact = *in++;
+            in = varbyteDecode(in, segment.count);
+            in = varbyteDecode(in, bytes);
+            segment.docs = in;
+            segments.push_back(segment);
+            in += bytes;
+        }
+        maxDocId = max(maxDocId, entry.maxDocId);
+    }
+    stable_sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b)
+                { return a.impact > b.impact; });
+
+    // accumulate, touched remembers which accumulators to read back and clear
+    vector<uint32_t> &acc = accumulators.accumulators;
+    vector<uint32_t> &touched = accumulators.touched;
+    if (maxDocId >= acc.size())
     {
-        total += entry.second;
+        acc.resize(maxDocId + 1, 0); // docIds past the page table, so no bounds check per posting below
+    }
+    size_t processed = 0;
+    for (const Segment &segment : segments)
+    {
+        const unsigned char *in = segment.docs;
+        uint32_t docId = 0;
+        uint32_t count = segment.count;
+        if (postingBudget > 0)
+        {
+            count = static_cast<uint32_t>(min<size_t>(count, postingBudget - processed));
+        }
+        for (uint32_t j = 0; j < count; ++j)
+        {
+            uint32_t gap;
+            in = varbyteDecode(in, gap);
+            docId += gap;
+            if (acc[docId] == 0)
+            {
+                touched.push_back(docId);
+            }
+            acc[docId] += segment.impact;
+        }
+        processed += count;
+        if (postingBudget > 0 && processed >= postingBudget)
+        {
+            break;
+        }
+    }
+
+    // top k of the accumulators, equal scores keep the smaller docId
+    priority_queue<ScoreDoc, vector<ScoreDoc>, MinHeapComp> topK;
+    for (uint32_t docId : touched)
+    {
+        double score = acc[docId];
+        acc[docId] = 0;
+        if (topK.size() < k)
+        {
+            topK.push({score, docId});
+        }
+        else if (score > topK.top().score || (score == topK.top().score && docId < topK.top().docId))
+        {
+            topK.pop();
+            topK.push({score, docId});
+        }
+    }
+    touched.clear();
+
+    vector<ScoreDoc> results;
+    while (!topK.empty())
+    {
+        results.push_back(topK.top());
+        topK.pop();
     }
-    return static_cast<double>(total) / pageTable.size();
+    return results;
 }
 
-vector<LexiconEntry> loadLexicon(ifstream &ifs, unordered_map<string, size_t> &termToIndex)
+// index written before lexicon.bin.fc: convert lexicon.bin into the same front-coded image in memory
+bool loadLexicon(ifstream &ifs, Lexicon &lexicon)
 {
-    vector<LexiconEntry> lexicon;
+    FrontCodedLexiconWriter<LexiconEntry> writer;
+    vector<unsigned char> &inlinePostings = writer.extra();
+    string term;
     uint32_t termSize;
     while (ifs.read(reinterpret_cast<char *>(&termSize), sizeof(termSize)))
     {
-        string term(termSize, '\0');
+        term.resize(termSize);
         ifs.read(&term[0], termSize);
 
         LexiconEntry entry;
         ifs.read(reinterpret_cast<char *>(&entry), sizeof(LexiconEntry));
 
-        termToIndex[term] = lexicon.size();
-        lexicon.push_back(entry);
+        // inline list: its bytes follow the entry, startBlock becomes their offset in the extra bytes
+        if (isInlineList(entry))
+        {
+            size_t offset = inlinePostings.size();
+            inlinePostings.resize(offset + entry.startBlock);
+            ifs.read(reinterpret_cast<char *>(inlinePostings.data() + offset), entry.startBlock);
+            entry.startBlock = static_cast<uint32_t>(offset);
+        }
+
+        writer.add(term.data(), term.size(), entry);
     }
-    return lexicon;
+
+    vector<char> image;
+    writer.build(image);
+    return lexicon.load(move(image));
 }
 
 vector<BlockMetadata> loadMetadata(ifstream &ifs)
@@ -628,38 +1290,70 @@ vector<BlockMetadata> loadMetadata(ifstream &ifs)
     return metadata;
 }
 
-void writeTrecResults(ofstream &ofs, uint32_t queryId, const vector<ScoreDoc> &rankedDocs, size_t k)
+// storage holds the bounds, the returned arrays point into it
+MaxScores loadMaxScores(ifstream &ifs, size_t blockCount, size_t termCount, vector<float> &storage)
 {
-    uint32_t rank = 1;
-    for (const ScoreDoc &entry : rankedDocs)
+    storage.resize(blockCount + termCount);
+    ifs.read(reinterpret_cast<char *>(storage.data()), storage.size() * sizeof(float));
+    if (!ifs || ifs.peek() != EOF)
     {
-        if (rank > k)
-        {
-            break; // only write top k
-        }
-        ofs << queryId << " Q0 " << entry.docId << " " << rank << " "
-            << std::fixed << std::setprecision(6) << entry.score
-            << " BM25\n";
-        ++rank;
+        // too short or too long: written for another index, its bounds would prune wrongly, fall back to exhaustive scoring
+        cerr << "max_scores.bin does not match the index, ignoring it" << endl;
+        return MaxScores();
     }
+    MaxScores maxScores;
+    maxScores.blocks = SegmentArray<float>(storage.data(), blockCount);
+    maxScores.terms = SegmentArray<float>(storage.data() + blockCount, termCount);
+    return maxScores;
 }
 
-void cleanQuery(string &query)
+// BATCH QUERY PROCESSING
+// threadCount threads pull the next query off a shared counter, every result goes to the query's slot
+// so the TREC files come out in the same order as a serial run; runQuery(query, thread) only shares read-only index
+// structures, cursors, heaps and accumulators are per query or per thread
+template <typename RunQuery>
+vector<vector<ScoreDoc>> runQueryBatch(const vector<pair<uint32_t, string>> &queries, unsigned threadCount, RunQuery &runQuery)
 {
-    string cleaned;
-    for (char c : query)
+    vector<vector<ScoreDoc>> results(queries.size());
+    atomic<size_t> nextQuery{0};
+    auto work = [&](unsigned thread)
     {
-        unsigned char uc = tolower((unsigned char)c);
-        if (uc <= 127 && !ispunct(uc))
+        for (size_t i = nextQuery++; i < queries.size(); i = nextQuery++)
         {
-            cleaned += uc; // valid non-punctuation ascii
+            results[i] = runQuery(queries[i].second, thread);
         }
-        else
+    };
+
+    threadCount = max(1u, min<unsigned>(threadCount, queries.size()));
+    vector<std::thread> threads;
+    for (unsigned t = 1; t < threadCount; ++t)
+    {
+        threads.emplace_back(work, t);
+    }
+    work(0);
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
+    return results;
+}
+
+// docIds are internal, passageIds (doc_ids.bin) turns them back into passage ids, an index without it used passage ids directly
+void writeTrecResults(ofstream &ofs, uint32_t queryId, const vector<ScoreDoc> &rankedDocs, size_t k, const SegmentArray<uint32_t> &passageIds)
+{
+    uint32_t rank = 1;
+    for (const ScoreDoc &entry : rankedDocs)
+    {
+        if (rank > k)
         {
-            cleaned += ' '; // replace separating characters with a space to split terms
+            break; // only write top k
         }
+        uint32_t passageId = entry.docId < passageIds.size() ? passageIds[entry.docId] : entry.docId;
+        ofs << queryId << " Q0 " << passageId << " " << rank << " "
+            << std::fixed << std::setprecision(6) << entry.score
+            << " BM25\n";
+        ++rank;
     }
-    query = cleaned;
 }
 
 unordered_map<uint32_t, string> loadActualQueries(ifstream &ifs)
@@ -673,50 +1367,80 @@ unordered_map<uint32_t, string> loadActualQueries(ifstream &ifs)
         stringstream ss(line);
         ss >> queryId;
         getline(ss, sentence);
-        cleanQuery(sentence);
-        mapping[queryId] = sentence;
+        mapping[queryId] = sentence; // normalized by the shared tokenizer in processQuery
     }
     return mapping;
 }
 
 vector<ScoreDoc> processQuery(const string &query,
-                              uint32_t queryId,
-                              unordered_map<string, size_t> &termToIndex,
-                              ifstream &indexIfs,
-                              const vector<LexiconEntry> &lexicon,
-                              const vector<BlockMetadata> &metadata,
-                              const vector<uint64_t> &blockOffsets,
-                              unordered_map<int, int> &pageTable,
-                              double averageDocLength)
+                              const Postings &postings,
+                              const Lexicon &lexicon,
+                              const SegmentArray<BlockMetadata> &metadata,
+                              const SegmentArray<uint64_t> &blockOffsets,
+                              const MaxScores &maxScores,
+                              Traversal traversal,
+                              const SegmentArray<uint32_t> &docLengths,
+                              double averageDocLength,
+                              double docCount)
 {
-    string term;
-    stringstream ss(query);
+    // same tokenizer as parsing so query terms match indexed terms
     vector<string> queryTerms;
-    while (ss >> term)
-    {
-        queryTerms.push_back(term);
-    }
+    vector<char> scratch;
+    tokenize(query.data(), query.size(), scratch, [&](const char *term, size_t len)
+             { queryTerms.emplace_back(term, len); });
 
-    bool atLeastOneFound = false;
     vector<ScoreDoc> results;
 
     vector<string> foundQueryTerms;
+    vector<size_t> termIndexes;
     for (const string &term : queryTerms)
     {
-        if (termToIndex.find(term) != termToIndex.end())
+        size_t termIndex;
+        if (lexicon.find(term, termIndex))
         {
             foundQueryTerms.push_back(term);
+            termIndexes.push_back(termIndex);
             // if all terms not found, no results
         }
     }
 
     if (!foundQueryTerms.empty())
     {
-        indexIfs.clear();
-        indexIfs.seekg(0, ios::beg);
-        results = disjunctiveDAAT(foundQueryTerms, termToIndex, indexIfs, lexicon, metadata, blockOffsets, pageTable, averageDocLength);
+        if (traversal == TRAVERSAL_MAXSCORE)
+        {
+            results = maxScoreDAAT(foundQueryTerms, termIndexes, postings, lexicon, metadata, blockOffsets, maxScores, docLengths, averageDocLength, docCount);
+        }
+        else if (traversal == TRAVERSAL_BMW)
+        {
+            results = blockMaxWAND(foundQueryTerms, termIndexes, postings, lexicon, metadata, blockOffsets, maxScores, docLengths, averageDocLength, docCount);
+        }
+        else
+        {
+            results = disjunctiveDAAT(foundQueryTerms, termIndexes, postings, lexicon, metadata, blockOffsets, docLengths, averageDocLength, docCount);
+        }
     }
 
     reverse(results.begin(), results.end());
     return results;
-}
\ No newline at end of file
+}
+
+vector<ScoreDoc> processImpactQuery(const string &query, const ImpactIndex &impacts, ImpactAccumulators &accumulators, size_t postingBudget)
+{
+    vector<size_t> termIndexes;
+    vector<char> scratch;
+    tokenize(query.data(), query.size(), scratch, [&](const char *term, size_t len)
+             {
+                 size_t termIndex;
+                 if (impacts.lexicon.find(term, len, termIndex))
+                 {
+                     termIndexes.push_back(termIndex);
+                 } });
+
+    vector<ScoreDoc> results;
+    if (!termIndexes.empty())
+    {
+        results = impactSAAT(termIndexes, impacts, accumulators, postingBudget);
+    }
+    reverse(results.begin(), results.end());
+    return results;
+}
@@ -0,0 +1,616 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <iomanip>
+#include <thread>
+#include <cstdio>
+#include "index_writer.h"
+#include "impact_index.h"
+#include "segment.h"
+using namespace std;
+
+// DOCUMENT REORDERING
+// reads the built index back, computes a new docId order with recursive graph bisection (BP) and rewrites every index
+// file under it: compressed_inverted_index.bin, lexicon.bin(.fc), metadata.bin, max_scores.bin, page_table.txt, doc_ids.bin,
+// and impact_index.bin / index.seg when they exist
+// docs sharing terms end up with close docIds, so gaps get smaller and block-max bounds tighter
+//
+// BP: the docs are split in two halves and docs are swapped between them while that lowers the estimated cost of
+// encoding the gaps (per term, deg * log2(n / (deg + 1)) in each half), then both halves are bisected again
+// this has to be the last build step: temp and merged files keep the old order
+
+// postings of the whole index in term order, docIds as they are on disk
+struct Postings
+{
+    vector<string> terms;
+    vector<uint64_t> termStart; // term i is [termStart[i], termStart[i + 1])
+    vector<uint32_t> docIds;
+    vector<uint32_t> freqs;
+    int codec = CODEC_AUTO;  // of the index read: the one codec all its blocks use, CODEC_AUTO if they mix codecs
+    bool termAligned = true; // false if a list starts inside a block (spanning layout)
+};
+
+// forward index of the terms BP looks at, doc d is [docStart[d], docStart[d + 1])
+struct DocTerms
+{
+    vector<uint64_t> docStart;
+    vector<uint32_t> terms;
+};
+
+// per thread, degrees are only touched for the terms of the docs being bisected and cleared afterwards
+struct BisectScratch
+{
+    vector<int32_t> leftDegree;
+    vector<int32_t> rightDegree;
+    vector<double> gains; // by position in the doc range
+};
+
+vector<double> log2Table; // log2Table[i] = log2(i), up to docCount + 1
+
+// appends one term's postings, decoded from the lexicon (inline list) or from its blocks
+void decodeList(const LexiconEntry &entry, const unsigned char *inlinePostings, const unsigned char *data,
+                const vector<BlockMetadata> &metadata, const vector<uint64_t> &blockOffsets, Postings &postings)
+{
+    if (isInlineList(entry))
+    {
+        const unsigned char *in = inlinePostings + entry.startBlock;
+        uint32_t docId = 0;
+        for (uint32_t i = 0; i < entry.listLength; ++i)
+        {
+            uint32_t gap, freq;
+            in = varbyteDecode(in, gap);
+            in = varbyteDecode(in, freq);
+            docId += gap;
+            postings.docIds.push_back(docId);
+            postings.freqs.push_back(freq);
+        }
+        return;
+    }
+
+    // whole blocks from startBlock on, the first startIndex postings belong to the previous term (spanning layout)
+    uint32_t docBuffer[BLOCK_CODEC_MAX_VALUES];
+    uint32_t freqBuffer[BLOCK_CODEC_MAX_VALUES];
+    uint32_t left = entry.listLength;
+    uint32_t skip = entry.startIndex;
+    for (uint32_t b = entry.startBlock; left > 0 && b < metadata.size(); ++b)
+    {
+        const BlockMetadata &block = metadata[b];
+        const unsigned char *in = data + blockOffsets[b];
+        size_t n = decodeBlockPart(blockDocCodec(block), in, blockDocSize(block), docBuffer);
+        prefixSum(docBuffer, n);
+        decodeBlockPart(blockFreqCodec(block), in + blockDocSize(block), block.freqSize, freqBuffer);
+        for (size_t i = skip; i < n && left > 0; ++i, --left)
+        {
+            postings.docIds.push_back(docBuffer[i]);
+            postings.freqs.push_back(freqBuffer[i]);
+        }
+        skip = 0;
+    }
+}
+
+bool loadPostings(Postings &postings, uint64_t &postingBytes)
+{
+    FrontCodedLexicon<LexiconEntry> lexicon;
+    MappedFile index;
+    ifstream metadataIfs("metadata.bin", ios::binary);
+    if (!lexicon.open(frontCodedLexiconFile("lexicon.bin")) || !index.open("compressed_inverted_index.bin") || !metadataIfs)
+    {
+        cerr << "Needs compressed_inverted_index.bin, lexicon.bin.fc and metadata.bin, run index first" << endl;
+        return false;
+    }
+    vector<BlockMetadata> metadata;
+    BlockMetadata block;
+    while (metadataIfs.read(reinterpret_cast<char *>(&block), sizeof(BlockMetadata)))
+    {
+        metadata.push_back(block);
+    }
+    vector<uint64_t> blockOffsets = computeBlockOffsets(metadata);
+    // the rewrite keeps the codec and layout of the index, so varbyte or spanning files stay that way
+    for (size_t b = 0; b < metadata.size(); ++b)
+    {
+        int docCodec = blockDocCodec(metadata[b]);
+        int freqCodec = blockFreqCodec(metadata[b]);
+        if (b == 0 && docCodec == freqCodec)
+        {
+            postings.codec = docCodec;
+        }
+        if (docCodec != postings.codec || freqCodec != postings.codec)
+        {
+            postings.codec = CODEC_AUTO;
+            break;
+        }
+    }
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(index.data);
+    postingBytes = index.size + lexicon.extraSize();
+
+    lexicon.forEachTerm([&](size_t termIndex, const string &term)
+                        {
+                            postings.terms.push_back(term);
+                            postings.termStart.push_back(postings.docIds.size());
+                            const LexiconEntry &entry = lexicon.entry(termIndex);
+                            postings.termAligned = postings.termAligned && (isInlineList(entry) || entry.startIndex == 0);
+                            decodeList(entry, lexicon.extra(), data, metadata, blockOffsets, postings); });
+    postings.termStart.push_back(postings.docIds.size());
+    return true;
+}
+
+// only terms in at least 2 docs can bring docs together, the rest would only cost time
+DocTerms buildDocTerms(const Postings &postings, uint32_t docCount, uint32_t minDocs)
+{
+    DocTerms forward;
+    forward.docStart.assign(docCount + 1, 0);
+    for (size_t t = 0; t + 1 < postings.termStart.size(); ++t)
+    {
+        if (postings.termStart[t + 1] - postings.termStart[t] < minDocs)
+        {
+            continue;
+        }
+        for (uint64_t i = postings.termStart[t]; i < postings.termStart[t + 1]; ++i)
+        {
+            ++forward.docStart[postings.docIds[i] + 1];
+        }
+    }
+    partial_sum(forward.docStart.begin(), forward.docStart.end(), forward.docStart.begin());
+
+    forward.terms.resize(forward.docStart[docCount]);
+    vector<uint64_t> fill(forward.docStart.begin(), forward.docStart.end() - 1);
+    for (size_t t = 0; t + 1 < postings.termStart.size(); ++t)
+    {
+        if (postings.termStart[t + 1] - postings.termStart[t] < minDocs)
+        {
+            continue;
+        }
+        for (uint64_t i = postings.termStart[t]; i < postings.termStart[t + 1]; ++i)
+        {
+            forward.terms[fill[postings.docIds[i]]++] = t;
+        }
+    }
+    return forward;
+}
+
+// estimated bits of a term's gaps in a half of n docs when deg of them hold it
+inline double gapCost(int32_t deg, uint32_t n)
+{
+    return deg * (log2Table[n] - log2Table[deg + 1]);
+}
+
+// cost saved by moving each doc of [begin, end) to the other half (sizes fromSize -> toSize)
+void computeGains(const DocTerms &forward, const uint32_t *docs, size_t begin, size_t end, vector<int32_t> &fromDegree,
+                  vector<int32_t> &toDegree, uint32_t fromSize, uint32_t toSize, vector<double> &gains)
+{
+    for (size_t i = begin; i < end; ++i)
+    {
+        uint32_t doc = docs[i];
+        double gain = 0;
+        for (uint64_t j = forward.docStart[doc]; j < forward.docStart[doc + 1]; ++j)
+        {
+            uint32_t t = forward.terms[j];
+            int32_t from = fromDegree[t];
+            int32_t to = toDegree[t];
+            gain += gapCost(from, fromSize) + gapCost(to, toSize) - gapCost(from - 1, fromSize) - gapCost(to + 1, toSize);
+        }
+        gains[i] = gain;
+    }
+}
+
+void addDegrees(const DocTerms &forward, const uint32_t *docs, size_t begin, size_t end, vector<int32_t> &degree, int32_t delta)
+{
+    for (size_t i = begin; i < end; ++i)
+    {
+        for (uint64_t j = forward.docStart[docs[i]]; j < forward.docStart[docs[i] + 1]; ++j)
+        {
+            degree[forward.terms[j]] += delta;
+        }
+    }
+}
+
+// f(begin, end) on threads chunks of [0, n), the calling thread takes the first one
+template <typename F>
+void parallelRanges(size_t n, unsigned threads, F f)
+{
+    threads = max<size_t>(1, min<size_t>(threads, n));
+    vector<thread> workers;
+    for (unsigned t = 1; t < threads; ++t)
+    {
+        workers.emplace_back(f, n * t / threads, n * (t + 1) / threads);
+    }
+    f(0, n / threads);
+    for (thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+// chunks sorted side by side, then merged pairwise, less is a total order so the result is the same for any thread count
+template <typename T, typename Less>
+void parallelSort(vector<T> &items, unsigned threads, Less less)
+{
+    size_t chunks = max<size_t>(1, min<size_t>(threads, items.size() / 1024));
+    vector<size_t> bounds(chunks + 1);
+    for (size_t c = 0; c <= chunks; ++c)
+    {
+        bounds[c] = items.size() * c / chunks;
+    }
+    parallelRanges(chunks, chunks, [&](size_t begin, size_t end)
+                   {
+                       for (size_t c = begin; c < end; ++c)
+                       {
+                           sort(items.begin() + bounds[c], items.begin() + bounds[c + 1], less);
+                       } });
+    for (size_t width = 1; width < chunks; width *= 2)
+    {
+        size_t pairs = (chunks + 2 * width - 1) / (2 * width);
+        parallelRanges(pairs, pairs, [&](size_t begin, size_t end)
+                       {
+                           for (size_t p = begin; p < end; ++p)
+                           {
+                               size_t first = 2 * width * p;
+                               if (first + width < chunks)
+                               {
+                                   inplace_merge(items.begin() + bounds[first], items.begin() + bounds[first + width],
+                                                 items.begin() + bounds[min(first + 2 * width, chunks)], less);
+                               }
+                           } });
+    }
+}
+
+// the left and right degrees are separate arrays, so with threads they are updated side by side
+template <typename F>
+void bothSides(unsigned threads, F f)
+{
+    if (threads > 1)
+    {
+        thread right(f, 1);
+        f(0);
+        right.join();
+    }
+    else
+    {
+        f(0);
+        f(1);
+    }
+}
+
+// one level of BP on docs[0, n): swap docs between the halves while it pays off, then bisect both halves
+// every level keeps all threads busy: the gains and sorts of a bisection are split over its threads,
+// and the two halves go to separate threads with half of them each
+void bisect(const DocTerms &forward, uint32_t *docs, size_t n, int depth, int iterations, unsigned threads, BisectScratch &scratch)
+{
+    if (depth == 0 || n < 32)
+    {
+        return;
+    }
+    size_t mid = n / 2;
+    uint32_t leftSize = mid;
+    uint32_t rightSize = n - mid;
+    vector<double> &gains = scratch.gains;
+    gains.resize(max(gains.size(), n));
+
+    vector<int32_t> *degrees[] = {&scratch.leftDegree, &scratch.rightDegree};
+    bothSides(threads, [&](int side)
+              { addDegrees(forward, docs, side == 0 ? 0 : mid, side == 0 ? mid : n, *degrees[side], 1); });
+    vector<size_t> leftOrder(mid), rightOrder(n - mid);
+    for (int iteration = 0; iteration < iterations; ++iteration)
+    {
+        parallelRanges(n, threads, [&](size_t begin, size_t end)
+                       {
+                           computeGains(forward, docs, begin, min(end, mid), scratch.leftDegree, scratch.rightDegree, leftSize, rightSize, gains);
+                           computeGains(forward, docs, max(begin, mid), end, scratch.rightDegree, scratch.leftDegree, rightSize, leftSize, gains); });
+
+        // best candidates of both sides first, ties by position so the result does not depend on the thread count
+        iota(leftOrder.begin(), leftOrder.end(), 0);
+        iota(rightOrder.begin(), rightOrder.end(), mid);
+        auto byGain = [&](size_t a, size_t b)
+        { return gains[a] != gains[b] ? gains[a] > gains[b] : a < b; };
+        parallelSort(leftOrder, threads, byGain);
+        parallelSort(rightOrder, threads, byGain);
+
+        // the gains are from before the swaps, so the pairs to swap are known up front
+        size_t swaps = 0;
+        while (swaps < leftOrder.size() && swaps < rightOrder.size() && gains[leftOrder[swaps]] + gains[rightOrder[swaps]] > 0)
+        {
+            swap(docs[leftOrder[swaps]], docs[rightOrder[swaps]]);
+            ++swaps;
+        }
+        if (swaps == 0)
+        {
+            break;
+        }
+        // swapped docs now sit at the other side's positions: leftOrder[i] came in on the left, rightOrder[i] left it
+        vector<size_t> *orders[] = {&leftOrder, &rightOrder};
+        bothSides(threads, [&](int side)
+                  {
+                      for (size_t i = 0; i < swaps; ++i)
+                      {
+                          size_t in = (*orders[side])[i];
+                          size_t out = (*orders[1 - side])[i];
+                          addDegrees(forward, docs, in, in + 1, *degrees[side], 1);
+                          addDegrees(forward, docs, out, out + 1, *degrees[side], -1);
+                      } });
+    }
+    bothSides(threads, [&](int side)
+              { addDegrees(forward, docs, side == 0 ? 0 : mid, side == 0 ? mid : n, *degrees[side], -1); });
+
+    if (threads > 1)
+    {
+        BisectScratch rightScratch;
+        rightScratch.leftDegree.assign(scratch.leftDegree.size(), 0);
+        rightScratch.rightDegree.assign(scratch.rightDegree.size(), 0);
+        thread right(bisect, cref(forward), docs + mid, n - mid, depth - 1, iterations, threads - threads / 2, ref(rightScratch));
+        bisect(forward, docs, mid, depth - 1, iterations, threads / 2, scratch);
+        right.join();
+    }
+    else
+    {
+        bisect(forward, docs, mid, depth - 1, iterations, 1, scratch);
+        bisect(forward, docs + mid, n - mid, depth - 1, iterations, 1, scratch);
+    }
+}
+
+// average log2 of the docId gaps, what BP tries to lower
+double averageLogGap(const Postings &postings, const vector<uint32_t> &newId)
+{
+    double total = 0;
+    vector<uint32_t> list;
+    for (size_t t = 0; t + 1 < postings.termStart.size(); ++t)
+    {
+        list.clear();
+        for (uint64_t i = postings.termStart[t]; i < postings.termStart[t + 1]; ++i)
+        {
+            list.push_back(newId[postings.docIds[i]]);
+        }
+        sort(list.begin(), list.end());
+        uint32_t prev = 0;
+        for (uint32_t docId : list)
+        {
+            total += log2(docId - prev + 1.0);
+            prev = docId;
+        }
+    }
+    return total / max<size_t>(1, postings.docIds.size());
+}
+
+// page table and passage ids in the new order, an index without doc_ids.bin has passage ids as docIds
+bool writeDocTables(const vector<uint32_t> &order, const vector<uint32_t> &docLengths, const string &pageTableFile, const string &docIdsFile)
+{
+    vector<uint32_t> passageIds;
+    ifstream docIdsIfs("doc_ids.bin", ios::binary);
+    uint32_t passageId;
+    while (docIdsIfs.read(reinterpret_cast<char *>(&passageId), sizeof(passageId)))
+    {
+        passageIds.push_back(passageId);
+    }
+    docIdsIfs.close();
+
+    ofstream pageTable(pageTableFile);
+    ofstream docIdsOfs(docIdsFile, ios::binary);
+    for (uint32_t docId = 0; docId < order.size(); ++docId)
+    {
+        uint32_t oldId = order[docId];
+        pageTable << docId << '\t' << docLengths[oldId] << '\n';
+        passageId = oldId < passageIds.size() ? passageIds[oldId] : oldId;
+        docIdsOfs.write(reinterpret_cast<const char *>(&passageId), sizeof(passageId));
+    }
+    return static_cast<bool>(pageTable) && static_cast<bool>(docIdsOfs);
+}
+
+int main(int argc, char *argv[])
+{
+    using namespace std::chrono;
+    auto startTime = high_resolution_clock::now();
+
+    // --iterations N swap rounds per bisection (default 20), --depth D bisection levels (default log2(docs) - 5)
+    // --threads N (default all cores), --codec / --spanning-blocks as for index, by default the index keeps its codec and layout
+    // --force replaces the index even when the new order does not make it smaller
+    int iterations = 20;
+    int depth = 0;
+    unsigned threadCount = max(1u, thread::hardware_concurrency());
+    int codec = CODEC_COUNT; // CODEC_COUNT and !spanning: same as the index read
+    bool spanning = false;
+    bool force = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc)
+        {
+            iterations = max(1, stoi(argv[++i]));
+        }
+        else if (arg == "--depth" && i + 1 < argc)
+        {
+            depth = max(1, stoi(argv[++i]));
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            threadCount = max(1, stoi(argv[++i]));
+        }
+        else if (arg == "--codec" && i + 1 < argc)
+        {
+            codec = codecFromName(argv[++i]);
+            if (codec == CODEC_COUNT)
+            {
+                cerr << "Unknown codec " << argv[i] << ", use varbyte, bitpack, pfor, streamvbyte or auto" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--spanning-blocks")
+        {
+            spanning = true;
+        }
+        else if (arg == "--force")
+        {
+            force = true;
+        }
+    }
+
+    Postings postings;
+    uint64_t bytesBefore = 0;
+    vector<uint32_t> docLengths;
+    double averageDocLength;
+    if (!loadPostings(postings, bytesBefore) || !loadDocLengths("page_table.txt", docLengths, averageDocLength))
+    {
+        cerr << "Failed to read the index or page_table.txt" << endl;
+        return 1;
+    }
+    uint32_t docCount = docLengths.size();
+    for (uint32_t docId : postings.docIds)
+    {
+        docCount = max(docCount, docId + 1);
+    }
+    docLengths.resize(docCount, 0);
+    uint64_t postingCount = postings.docIds.size();
+    if (depth == 0)
+    {
+        depth = max(1, static_cast<int>(log2(max(docCount, 2u))) - 5);
+    }
+    cout << "Read " << postingCount << " postings of " << postings.terms.size() << " terms, " << docCount << " docs" << endl;
+    if (codec == CODEC_COUNT)
+    {
+        codec = postings.codec;
+    }
+    bool termAligned = postings.termAligned && !spanning;
+    bool reencoded = codec != postings.codec || termAligned != postings.termAligned;
+
+    vector<uint32_t> identity(docCount);
+    iota(identity.begin(), identity.end(), 0);
+    double logGapBefore = averageLogGap(postings, identity);
+
+    // order[newId] = old docId, starting from the current order
+    log2Table.resize(docCount + 2);
+    for (size_t i = 1; i < log2Table.size(); ++i)
+    {
+        log2Table[i] = log2(static_cast<double>(i));
+    }
+    DocTerms forward = buildDocTerms(postings, docCount, 2);
+    vector<uint32_t> order = identity;
+    BisectScratch scratch;
+    scratch.leftDegree.assign(postings.terms.size(), 0);
+    scratch.rightDegree.assign(postings.terms.size(), 0);
+    auto bpStart = high_resolution_clock::now();
+    bisect(forward, order.data(), docCount, depth, iterations, threadCount, scratch);
+    auto bpEnd = high_resolution_clock::now();
+    forward = DocTerms();
+
+    vector<uint32_t> newId(docCount);
+    for (uint32_t docId = 0; docId < docCount; ++docId)
+    {
+        newId[order[docId]] = docId;
+    }
+    double logGapAfter = averageLogGap(postings, newId);
+    cout << "BP: depth " << depth << ", " << iterations << " iterations, " << threadCount << " threads, "
+         << duration_cast<milliseconds>(bpEnd - bpStart).count() << " ms" << endl;
+
+    // every file is written under a staged name and renamed over the index only once all of them are written,
+    // a failed run leaves the old index as it was instead of doc tables in the new order next to postings in the old one
+    vector<pair<string, string>> outputs; // (staged, final)
+    auto stage = [&](const string &staged, const string &file)
+    {
+        outputs.push_back({staged, file});
+        return staged;
+    };
+    auto fail = [&](const string &message)
+    {
+        cerr << message << ", index left unchanged" << endl;
+        for (const auto &output : outputs)
+        {
+            remove(output.first.c_str());
+        }
+        return 1;
+    };
+    string pageTableFile = stage("page_table.txt.reorder", "page_table.txt");
+    string docIdsFile = stage("doc_ids.bin.reorder", "doc_ids.bin");
+    string indexFile = stage("compressed_inverted_index.bin.reorder", "compressed_inverted_index.bin");
+    string lexiconFile = stage("lexicon.bin.reorder", "lexicon.bin");
+    stage(frontCodedLexiconFile(lexiconFile), frontCodedLexiconFile("lexicon.bin"));
+    string metadataFile = stage("metadata.bin.reorder", "metadata.bin");
+    string maxScoresFile = stage("max_scores.bin.reorder", "max_scores.bin");
+
+    // page table first, the writers compute max scores and impacts from it
+    if (!writeDocTables(order, docLengths, pageTableFile, docIdsFile))
+    {
+        return fail("Failed to write page_table.txt or doc_ids.bin");
+    }
+
+    IndexWriter writer;
+    writer.setCodec(codec);
+    writer.setTermAligned(termAligned);
+    cout << "Writing " << codecName(codec) << " blocks, " << (termAligned ? "term-aligned" : "spanning") << " layout" << endl;
+    if (!writer.open(indexFile, lexiconFile, metadataFile) || !writer.setMaxScores(maxScoresFile, pageTableFile))
+    {
+        return fail("Failed to open index output files");
+    }
+    bool impact = ifstream("impact_index.bin").good();
+    ImpactWriter impactWriter;
+    if (impact && !impactWriter.open(stage("impact_index.bin.reorder", "impact_index.bin"),
+                                      stage("impact_lexicon.bin.reorder", "impact_lexicon.bin"), pageTableFile))
+    {
+        return fail("Failed to open impact index output files");
+    }
+
+    vector<pair<uint32_t, uint32_t>> list; // (new docId, freq) of one term
+    for (size_t t = 0; t < postings.terms.size(); ++t)
+    {
+        list.clear();
+        for (uint64_t i = postings.termStart[t]; i < postings.termStart[t + 1]; ++i)
+        {
+            list.push_back({newId[postings.docIds[i]], postings.freqs[i]});
+        }
+        sort(list.begin(), list.end());
+        const string &term = postings.terms[t];
+        for (const auto &posting : list)
+        {
+            writer.add(term.data(), term.size(), posting.first, posting.second);
+            if (impact)
+            {
+                impactWriter.add(term.data(), term.size(), posting.first, posting.second);
+            }
+        }
+    }
+    writer.close();
+    if (impact)
+    {
+        impactWriter.close();
+    }
+    if (ifstream("index.seg").good() &&
+        writeSegment(stage("index.seg.reorder", "index.seg"), indexFile, lexiconFile, metadataFile, maxScoresFile, pageTableFile, docIdsFile) == 0)
+    {
+        return fail("Failed to write index.seg");
+    }
+
+    // same codec and layout: the new order is only worth keeping if it shrinks the index
+    FrontCodedLexicon<LexiconEntry> lexicon;
+    lexicon.open(frontCodedLexiconFile(lexiconFile));
+    ifstream indexIfs(indexFile, ios::binary | ios::ate);
+    uint64_t bytesAfter = static_cast<uint64_t>(indexIfs.tellg()) + lexicon.extraSize();
+    indexIfs.close();
+    cout << fixed << setprecision(3);
+    cout << "Bits per posting: " << 8.0 * bytesBefore / postingCount << " -> " << 8.0 * bytesAfter / postingCount << endl;
+    cout << "Average log2 gap: " << logGapBefore << " -> " << logGapAfter << endl;
+    if (bytesAfter >= bytesBefore && !reencoded && !force)
+    {
+        for (const auto &output : outputs)
+        {
+            remove(output.first.c_str());
+        }
+        cout << "New order does not shrink the index, original order kept (--force to replace it)" << endl;
+    }
+    else
+    {
+        for (const auto &output : outputs)
+        {
+            if (rename(output.first.c_str(), output.second.c_str()) != 0)
+            {
+                cerr << "Failed to rename " << output.first << " to " << output.second << endl;
+                return 1;
+            }
+        }
+    }
+
+    auto endTime = high_resolution_clock::now();
+    auto duration = duration_cast<milliseconds>(endTime - startTime).count();
+    std::cout << "Elapsed time: " << duration << " ms" << std::endl;
+}
@@ -0,0 +1,346 @@
+#pragma once
+
+// on-disk format of the sorted runs written by parsing (tempN.bin) and merging (final_merged.bin)
+//
+// postings are grouped by term, each term is written once:
+//   varbyte sharedPrefixLen   bytes shared with the previous term in the file (front coding)
+//   varbyte suffixLen
+//   suffix bytes
+//   varbyte postingCount
+//   postingCount x (varbyte docId gap, varbyte freq)   gaps restart from 0 for every term
+//
+// runs written with a sparse index (tempN.bin.idx) restart front coding (sharedPrefixLen = 0) about every RUN_INDEX_INTERVAL bytes,
+// the index lists (uint64 offset, uint32 termLen, term) of each restart so a reader can seek straight to a term range
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+const uint64_t RUN_INDEX_INTERVAL = 64 * 1024;
+
+struct RunIndexEntry
+{
+    std::string term;
+    uint64_t offset; // byte offset of the term header in the run
+};
+
+inline std::string runIndexFile(const std::string &runFile)
+{
+    return runFile + ".idx";
+}
+
+inline bool loadRunIndex(const std::string &runFile, std::vector<RunIndexEntry> &entries)
+{
+    std::ifstream ifs(runIndexFile(runFile), std::ios::binary);
+    if (!ifs)
+    {
+        return false;
+    }
+    entries.clear();
+    RunIndexEntry entry;
+    uint32_t termLen;
+    while (ifs.read(reinterpret_cast<char *>(&entry.offset), sizeof(entry.offset)) &&
+           ifs.read(reinterpret_cast<char *>(&termLen), sizeof(termLen)))
+    {
+        entry.term.resize(termLen);
+        ifs.read(&entry.term[0], termLen);
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+inline void appendVarbyte(std::vector<char> &buffer, uint32_t num)
+{
+    while (num >= 128)
+    {
+        buffer.push_back(static_cast<char>(128 + (num & 127))); // set the 1 and then the next 7 bits
+        num >>= 7;
+    }
+    buffer.push_back(static_cast<char>(num)); // without the 1 bit at the front
+}
+
+// streams postings sorted by (term, docId) into the run format
+class RunWriter
+{
+public:
+    bool open(const std::string &filename, size_t bufferSize = 1 << 20, bool withIndex = false)
+    {
+        ofs.open(filename, std::ios::binary);
+        indexFilename = withIndex ? runIndexFile(filename) : "";
+        index.clear();
+        nextRestart = 0;
+        outputBuf.clear();
+        outputBuf.reserve(bufferSize);
+        flushThreshold = bufferSize;
+        prevTerm.clear();
+        haveTerm = false;
+        written = 0;
+        return static_cast<bool>(ofs);
+    }
+
+    void add(const char *term, size_t termLen, uint32_t docId, uint32_t freq)
+    {
+        if (!haveTerm || termLen != currentTerm.size() || memcmp(term, currentTerm.data(), termLen) != 0)
+        {
+            finishTerm();
+            currentTerm.assign(term, termLen);
+            postingCount = 0;
+            lastDocId = 0;
+            haveTerm = true;
+        }
+
+        appendVarbyte(postings, docId - lastDocId);
+        appendVarbyte(postings, freq);
+        lastDocId = docId;
+        ++postingCount;
+    }
+
+    void close()
+    {
+        finishTerm();
+        flush();
+        ofs.close();
+
+        if (!indexFilename.empty())
+        {
+            std::ofstream idx(indexFilename, std::ios::binary);
+            for (const RunIndexEntry &entry : index)
+            {
+                uint32_t termLen = entry.term.size();
+                idx.write(reinterpret_cast<const char *>(&entry.offset), sizeof(entry.offset));
+                idx.write(reinterpret_cast<const char *>(&termLen), sizeof(termLen));
+                idx.write(entry.term.data(), termLen);
+            }
+        }
+    }
+
+    uint64_t bytesWritten() const
+    {
+        return written;
+    }
+
+private:
+    void finishTerm()
+    {
+        if (!haveTerm)
+        {
+            return;
+        }
+
+        // front code against the previous term, unless this term is a restart point of the sparse index
+        uint64_t offset = written + outputBuf.size();
+        size_t shared = 0;
+        if (!indexFilename.empty() && offset >= nextRestart)
+        {
+            index.push_back(RunIndexEntry{currentTerm, offset});
+            nextRestart = offset + RUN_INDEX_INTERVAL;
+        }
+        else
+        {
+            size_t maxShared = std::min(prevTerm.size(), currentTerm.size());
+            while (shared < maxShared && prevTerm[shared] == currentTerm[shared])
+            {
+                ++shared;
+            }
+        }
+
+        appendVarbyte(outputBuf, shared);
+        appendVarbyte(outputBuf, currentTerm.size() - shared);
+        outputBuf.insert(outputBuf.end(), currentTerm.begin() + shared, currentTerm.end());
+        appendVarbyte(outputBuf, postingCount);
+        outputBuf.insert(outputBuf.end(), postings.begin(), postings.end());
+        postings.clear();
+
+        prevTerm.swap(currentTerm);
+        haveTerm = false;
+
+        if (outputBuf.size() >= flushThreshold)
+        {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        ofs.write(outputBuf.data(), outputBuf.size());
+        written += outputBuf.size();
+        outputBuf.clear();
+    }
+
+    std::ofstream ofs;
+    std::vector<char> outputBuf; // encoded terms waiting to be written
+    size_t flushThreshold = 0;
+    uint64_t written = 0;
+
+    std::string indexFilename; // empty when no sparse index is written
+    std::vector<RunIndexEntry> index;
+    uint64_t nextRestart = 0; // first offset at which the next term becomes a restart point
+
+    std::string prevTerm;    // last term written, base for front coding
+    std::string currentTerm; // term whose postings are being collected
+    std::vector<char> postings; // encoded (gap, freq) pairs of currentTerm
+    uint32_t postingCount = 0;
+    uint32_t lastDocId = 0;
+    bool haveTerm = false;
+};
+
+// reads a run back one posting at a time through its own read buffer, term() stays valid until next() moves past the term
+// fields and term suffixes may straddle buffer refills, they are read byte by byte / piece by piece across the boundary
+class RunReader
+{
+public:
+    bool open(const std::string &filename, size_t bufferSize = 1 << 20)
+    {
+        ifs.open(filename, std::ios::binary);
+        buffer.resize(std::max<size_t>(bufferSize, 16));
+        pos = end = 0;
+        currentTerm.clear();
+        remaining = 0;
+        bytesRead = 0;
+        return static_cast<bool>(ifs);
+    }
+
+    bool next()
+    {
+        if (remaining == 0)
+        {
+            // next term header
+            uint32_t shared, suffixLen;
+            if (!readVarbyte(shared))
+            {
+                return false; // end of run
+            }
+            if (!readVarbyte(suffixLen) || shared > currentTerm.size())
+            {
+                return false;
+            }
+            currentTerm.resize(shared + suffixLen);
+            if (!readBytes(&currentTerm[shared], suffixLen))
+            {
+                return false;
+            }
+            if (!readVarbyte(remaining) || remaining == 0)
+            {
+                return false;
+            }
+            lastDocId = 0;
+        }
+
+        uint32_t gap;
+        if (!readVarbyte(gap) || !readVarbyte(freq))
+        {
+            return false;
+        }
+        docId = lastDocId + gap;
+        lastDocId = docId;
+        --remaining;
+        return true;
+    }
+
+    const std::string &term() const
+    {
+        return currentTerm;
+    }
+
+    // jump to a restart point from the run's sparse index
+    bool seek(uint64_t offset)
+    {
+        ifs.clear();
+        ifs.seekg(offset);
+        pos = end = 0;
+        currentTerm.clear();
+        remaining = 0;
+        return static_cast<bool>(ifs);
+    }
+
+    void close()
+    {
+        ifs.close();
+    }
+
+    uint32_t docId = 0;
+    uint32_t freq = 0;
+    uint64_t bytesRead = 0;
+
+private:
+    bool refill()
+    {
+        if (!ifs)
+        {
+            return false;
+        }
+        ifs.read(buffer.data(), buffer.size());
+        pos = 0;
+        end = ifs.gcount();
+        return end > 0;
+    }
+
+    bool readVarbyte(uint32_t &num)
+    {
+        num = 0;
+        // fast path: a whole varbyte (at most 5 bytes) is in the buffer
+        if (end - pos >= 5)
+        {
+            const unsigned char *p = reinterpret_cast<const unsigned char *>(buffer.data()) + pos;
+            const unsigned char *start = p;
+            uint32_t shift = 0;
+            while (*p >= 128 && shift < 28)
+            {
+                num |= static_cast<uint32_t>(*p++ & 127) << shift;
+                shift += 7;
+            }
+            num |= static_cast<uint32_t>(*p++) << shift;
+            pos += p - start;
+            bytesRead += p - start;
+            return true;
+        }
+
+        // near the end of the buffer: one byte at a time, refilling in between
+        uint32_t shift = 0;
+        while (true)
+        {
+            if (pos == end && !refill())
+            {
+                return false;
+            }
+            unsigned char curr = buffer[pos++];
+            ++bytesRead;
+            num |= static_cast<uint32_t>(curr & 127) << shift;
+            if (curr < 128)
+            {
+                return true;
+            }
+            shift += 7;
+        }
+    }
+
+    bool readBytes(char *out, size_t len)
+    {
+        while (len > 0)
+        {
+            if (pos == end && !refill())
+            {
+                return false;
+            }
+            size_t chunk = std::min(len, end - pos);
+            memcpy(out, buffer.data() + pos, chunk);
+            out += chunk;
+            len -= chunk;
+            pos += chunk;
+            bytesRead += chunk;
+        }
+        return true;
+    }
+
+    std::ifstream ifs;
+    std::vector<char> buffer;
+    size_t pos = 0; // next unread byte in buffer
+    size_t end = 0; // bytes of buffer filled by the last refill
+    std::string currentTerm;
+    uint32_t remaining = 0; // postings left in currentTerm
+    uint32_t lastDocId = 0;
+};
@@ -0,0 +1,301 @@
+#pragma once
+
+// single-file index segment (index.seg), packed by `index --segment` from the files of the blocked index and
+// memory-mapped by `querying --segment`, so startup parses nothing and several query processes share the page cache
+//
+// layout: SegmentHeader, then one section per SegmentSectionId, each starting on a SEGMENT_PAGE_SIZE boundary
+//   SECTION_POSTINGS       compressed_inverted_index.bin
+//   SECTION_LEXICON        lexicon.bin.fc (see front_coded_lexicon.h)
+//   SECTION_METADATA       metadata.bin, one BlockMetadata per block
+//   SECTION_BLOCK_OFFSETS  one uint64 per block, offset of the block in the segment file (not in the postings section)
+//   SECTION_MAX_SCORES     max_scores.bin, empty if there was none
+//   SECTION_DOC_LENGTHS    uint32 doc length indexed by docId (0 for docIds not in the page table)
+//   SECTION_DOC_IDS        doc_ids.bin, uint32 passage id indexed by docId, empty for an index built on passage ids
+// every section has an FNV-1a checksum, only checked on request since it reads the whole file
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include "index_writer.h" // BlockMetadata, loadDocLengths
+#include "tokenizer.h"    // MappedFile
+
+const uint32_t SEGMENT_MAGIC = 0x47455357; // "WSEG"
+const uint32_t SEGMENT_VERSION = 3; // 2: SECTION_DOC_IDS, 3: docCount is the page table line count (BM25's N)
+const uint64_t SEGMENT_PAGE_SIZE = 4096;
+
+enum SegmentSectionId
+{
+    SECTION_POSTINGS,
+    SECTION_LEXICON,
+    SECTION_METADATA,
+    SECTION_BLOCK_OFFSETS,
+    SECTION_MAX_SCORES,
+    SECTION_DOC_LENGTHS,
+    SECTION_DOC_IDS,
+    SEGMENT_SECTION_COUNT
+};
+
+struct SegmentSection
+{
+    uint64_t offset; // from the start of the file, page aligned
+    uint64_t size;   // bytes
+    uint64_t checksum;
+};
+
+struct SegmentHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sectionCount;
+    uint32_t pageSize;
+    uint64_t docCount; // documents in the page table, BM25's N
+    double averageDocLength;
+    SegmentSection sections[SEGMENT_SECTION_COUNT];
+};
+
+// read-only array pointing into a mapping (or at a vector's data), so the query code is the same for both
+template <typename T>
+struct SegmentArray
+{
+    const T *items = nullptr;
+    size_t count = 0;
+
+    SegmentArray() = default;
+    SegmentArray(const T *items, size_t count) : items(items), count(count) {}
+    SegmentArray(const std::vector<T> &v) : items(v.data()), count(v.size()) {}
+
+    const T &operator[](size_t i) const
+    {
+        return items[i];
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    const T *data() const
+    {
+        return items;
+    }
+};
+
+inline uint64_t segmentChecksum(const void *data, size_t size, uint64_t hash = 1469598103934665603ULL)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// offset of every block in the postings, computed once from the compressed sizes in the metadata
+inline std::vector<uint64_t> computeBlockOffsets(const std::vector<BlockMetadata> &metadata, uint64_t base = 0)
+{
+    std::vector<uint64_t> offsets(metadata.size());
+    uint64_t off = base;
+    for (size_t i = 0; i < metadata.size(); ++i)
+    {
+        offsets[i] = off;
+        off += (uint64_t)blockDocSize(metadata[i]) + (uint64_t)metadata[i].freqSize;
+    }
+    return offsets;
+}
+
+// packs the blocked index files into one segment, returns bytes written, 0 on failure
+inline uint64_t writeSegment(const std::string &segmentFile, const std::string &indexFile, const std::string &lexiconFile,
+                             const std::string &metadataFile, const std::string &maxScoresFile, const std::string &pageTableFile,
+                             const std::string &docIdsFile)
+{
+    std::ifstream indexIfs(indexFile, std::ios::binary);
+    std::ifstream lexiconIfs(frontCodedLexiconFile(lexiconFile), std::ios::binary);
+    std::ifstream metadataIfs(metadataFile, std::ios::binary);
+    std::vector<uint32_t> docLengths;
+    SegmentHeader header{};
+    if (!indexIfs || !lexiconIfs || !metadataIfs || !loadDocLengths(pageTableFile, docLengths, header.averageDocLength, &header.docCount))
+    {
+        std::cerr << "Segment needs " << indexFile << ", " << frontCodedLexiconFile(lexiconFile) << ", "
+                  << metadataFile << " and " << pageTableFile << std::endl;
+        return 0;
+    }
+    header.magic = SEGMENT_MAGIC;
+    header.version = SEGMENT_VERSION;
+    header.sectionCount = SEGMENT_SECTION_COUNT;
+    header.pageSize = SEGMENT_PAGE_SIZE;
+
+    std::vector<BlockMetadata> metadata;
+    BlockMetadata block;
+    while (metadataIfs.read(reinterpret_cast<char *>(&block), sizeof(BlockMetadata)))
+    {
+        metadata.push_back(block);
+    }
+
+    std::ofstream ofs(segmentFile, std::ios::binary);
+    if (!ofs)
+    {
+        std::cerr << "Failed to open " << segmentFile << std::endl;
+        return 0;
+    }
+    ofs.write(reinterpret_cast<const char *>(&header), sizeof(header)); // rewritten once the sections are known
+    uint64_t written = sizeof(header);
+
+    std::vector<char> chunk(1 << 20);
+    auto beginSection = [&](int id)
+    {
+        uint64_t padding = (SEGMENT_PAGE_SIZE - written % SEGMENT_PAGE_SIZE) % SEGMENT_PAGE_SIZE;
+        std::fill(chunk.begin(), chunk.begin() + padding, 0);
+        ofs.write(chunk.data(), padding);
+        written += padding;
+        header.sections[id] = SegmentSection{written, 0, segmentChecksum(nullptr, 0)};
+    };
+    auto appendBytes = [&](int id, const void *data, size_t size)
+    {
+        ofs.write(static_cast<const char *>(data), size);
+        header.sections[id].size += size;
+        header.sections[id].checksum = segmentChecksum(data, size, header.sections[id].checksum);
+        written += size;
+    };
+    // files are copied in chunks, the postings can be larger than memory
+    auto appendFile = [&](int id, std::ifstream &ifs)
+    {
+        while (ifs.read(chunk.data(), chunk.size()) || ifs.gcount() > 0)
+        {
+            appendBytes(id, chunk.data(), ifs.gcount());
+        }
+    };
+
+    beginSection(SECTION_POSTINGS);
+    appendFile(SECTION_POSTINGS, indexIfs);
+    uint64_t postingsOffset = header.sections[SECTION_POSTINGS].offset;
+
+    beginSection(SECTION_LEXICON);
+    appendFile(SECTION_LEXICON, lexiconIfs);
+
+    beginSection(SECTION_METADATA);
+    appendBytes(SECTION_METADATA, metadata.data(), metadata.size() * sizeof(BlockMetadata));
+
+    beginSection(SECTION_BLOCK_OFFSETS);
+    std::vector<uint64_t> blockOffsets = computeBlockOffsets(metadata, postingsOffset);
+    appendBytes(SECTION_BLOCK_OFFSETS, blockOffsets.data(), blockOffsets.size() * sizeof(uint64_t));
+
+    beginSection(SECTION_MAX_SCORES);
+    std::ifstream maxScoresIfs(maxScoresFile, std::ios::binary);
+    if (maxScoresIfs)
+    {
+        appendFile(SECTION_MAX_SCORES, maxScoresIfs);
+    }
+
+    beginSection(SECTION_DOC_LENGTHS);
+    appendBytes(SECTION_DOC_LENGTHS, docLengths.data(), docLengths.size() * sizeof(uint32_t));
+
+    beginSection(SECTION_DOC_IDS);
+    std::ifstream docIdsIfs(docIdsFile, std::ios::binary);
+    if (docIdsIfs)
+    {
+        appendFile(SECTION_DOC_IDS, docIdsIfs);
+    }
+
+    ofs.seekp(0);
+    ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    return ofs ? written : 0;
+}
+
+// read side: the whole segment is one mapping, sections are handed out as pointers into it
+class Segment
+{
+public:
+    bool open(const std::string &filename)
+    {
+        if (!file.open(filename, MADV_RANDOM))
+        {
+            std::cerr << "Failed to open " << filename << std::endl;
+            return false;
+        }
+        if (file.size < sizeof(SegmentHeader))
+        {
+            std::cerr << filename << " is too small to be a segment" << std::endl;
+            return false;
+        }
+        memcpy(&header, file.data, sizeof(header));
+        if (header.magic != SEGMENT_MAGIC || header.version != SEGMENT_VERSION || header.sectionCount != SEGMENT_SECTION_COUNT)
+        {
+            std::cerr << filename << " has an unknown segment format or version" << std::endl;
+            return false;
+        }
+        for (int id = 0; id < SEGMENT_SECTION_COUNT; ++id)
+        {
+            const SegmentSection &section = header.sections[id];
+            if (section.offset % SEGMENT_PAGE_SIZE != 0 || section.offset + section.size > file.size)
+            {
+                std::cerr << filename << " is truncated" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // reads every section, for checking a copied or suspect segment
+    bool verify() const
+    {
+        for (int id = 0; id < SEGMENT_SECTION_COUNT; ++id)
+        {
+            if (segmentChecksum(bytes(id), header.sections[id].size) != header.sections[id].checksum)
+            {
+                std::cerr << "Segment section " << id << " fails its checksum" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // start of the mapping, the block offsets count from here
+    const unsigned char *data() const
+    {
+        return reinterpret_cast<const unsigned char *>(file.data);
+    }
+
+    // access pattern hint for one section (e.g. the postings), overriding the MADV_RANDOM of the whole file
+    void advise(int id, int advice) const
+    {
+        adviseRange(file.data, header.sections[id].offset, header.sections[id].offset + header.sections[id].size, advice);
+    }
+
+    const unsigned char *bytes(int id) const
+    {
+        return reinterpret_cast<const unsigned char *>(file.data) + header.sections[id].offset;
+    }
+
+    uint64_t size(int id) const
+    {
+        return header.sections[id].size;
+    }
+
+    template <typename T>
+    SegmentArray<T> array(int id) const
+    {
+        return SegmentArray<T>(reinterpret_cast<const T *>(bytes(id)), size(id) / sizeof(T));
+    }
+
+    double averageDocLength() const
+    {
+        return header.averageDocLength;
+    }
+
+    uint64_t docCount() const
+    {
+        return header.docCount;
+    }
+
+private:
+    MappedFile file;
+    SegmentHeader header{};
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+// shared by parsing.cpp and querying.cpp so passages and queries are normalized the same way
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cctype>
+#include <cstring>
+#include <cstdint>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// read-only memory mapping of a whole file, so input can be scanned in place without getline copies
+struct MappedFile
+{
+    const char *data = nullptr;
+    size_t size = 0;
+
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    // advice: MADV_SEQUENTIAL for input scanned front to back, MADV_RANDOM for lookup structures
+    bool open(const std::string &filename, int advice = MADV_SEQUENTIAL)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+
+        if (size > 0)
+        {
+            void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr == MAP_FAILED)
+            {
+                ::close(fd);
+                return false;
+            }
+            data = static_cast<const char *>(ptr);
+            madvise(ptr, size, advice);
+        }
+        ::close(fd); // mapping stays valid after the fd is closed
+        return true;
+    }
+
+    void close()
+    {
+        if (data != nullptr)
+        {
+            munmap(const_cast<char *>(data), size);
+            data = nullptr;
+        }
+        size = 0;
+    }
+};
+
+// madvise on bytes [begin, end) of a mapping, widened to whole pages
+inline void adviseRange(const void *base, uint64_t begin, uint64_t end, int advice)
+{
+    static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t start = begin & ~(pageSize - 1);
+    if (end > start)
+    {
+        madvise(const_cast<char *>(static_cast<const char *>(base)) + start, end - start, advice);
+    }
+}
+
+// a byte is part of a term if it is ascii, not punctuation and not whitespace
+// (same as the old cleanSentence/cleanQuery replacing punctuation and utf-8 bytes with spaces, then splitting on whitespace)
+inline bool isTermByte(unsigned char c)
+{
+    return c <= 127 && !ispunct(c) && !isspace(c);
+}
+
+#if defined(__SSE2__)
+// lowercase 16 bytes into out and return a bitmask of the bytes that are part of a term
+inline uint32_t normalizeChunk(const char *in, char *out)
+{
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+
+    // signed compares: bytes >= 0x80 are negative so they fall outside every range below
+    auto inRange = [&](char lo, char hi)
+    {
+        return _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8(hi + 1)));
+    };
+
+    __m128i upper = inRange('A', 'Z');
+    __m128i termBytes = _mm_or_si128(upper, inRange('a', 'z'));
+    termBytes = _mm_or_si128(termBytes, inRange('0', '9'));
+    termBytes = _mm_or_si128(termBytes, inRange(0x00, 0x08)); // control characters that are not whitespace
+    termBytes = _mm_or_si128(termBytes, inRange(0x0E, 0x1F));
+    termBytes = _mm_or_si128(termBytes, _mm_cmpeq_epi8(x, _mm_set1_epi8(0x7F)));
+
+    __m128i lowered = _mm_add_epi8(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), lowered);
+    return static_cast<uint32_t>(_mm_movemask_epi8(termBytes));
+}
+#else
+inline uint32_t normalizeChunk(const char *in, char *out)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        unsigned char c = in[i];
+        out[i] = tolower(c);
+        if (isTermByte(c))
+        {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+#endif
+
+// lowercase text into scratch 16 bytes at a time and call onTerm(const char *term, size_t len) for every term,
+// term pointers point into scratch, which is reused between calls so there is no allocation per term
+template <typename OnTerm>
+void tokenize(const char *text, size_t len, std::vector<char> &scratch, OnTerm &&onTerm)
+{
+    size_t padded = (len + 15) & ~size_t(15);
+    if (scratch.size() < padded)
+    {
+        scratch.resize(padded);
+    }
+    char *out = scratch.data();
+
+    bool inTerm = false;
+    size_t termStart = 0;
+    for (size_t base = 0; base < len; base += 16)
+    {
+        uint32_t mask;
+        if (base + 16 <= len)
+        {
+            mask = normalizeChunk(text + base, out + base);
+        }
+        else
+        {
+            // tail: pad with spaces, which are separators, so the mask needs no fixing
+            char tail[16];
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, text + base, len - base);
+            mask = normalizeChunk(tail, out + base);
+        }
+
+        // walk term boundaries in the mask instead of testing every byte
+        uint32_t pos = 0;
+        while (pos < 16)
+        {
+            if (!inTerm)
+            {
+                uint32_t rest = mask >> pos;
+                if (rest == 0)
+                {
+                    break;
+                }
+                pos += __builtin_ctz(rest);
+                termStart = base + pos;
+                inTerm = true;
+            }
+            else
+            {
+                uint32_t rest = (~mask & 0xFFFF) >> pos;
+                if (rest == 0)
+                {
+                    break;
+                }
+                pos += __builtin_ctz(rest);
+                onTerm(out + termStart, base + pos - termStart);
+                inTerm = false;
+            }
+        }
+    }
+
+    if (inTerm)
+    {
+        onTerm(out + termStart, len - termStart);
+    }
+}